@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+
+namespace db {
+
+  /* 128-bit hash of the compiler build, the options and the source, in hex */
+  const size_t CACHE_KEY_SIZE = 32;
+
+  struct CompileCache {
+    char directory[PATH_MAX];
+    char key[CACHE_KEY_SIZE + 1];
+    uint64_t sizeLimit;
+  };
+
+  typedef unsigned __int128 CacheHash;
+
+  /* GenerateELF and a hit both leave the ELF with this mode, whatever the umask */
+  const unsigned ELF_FILE_MODE = 0755;
+
+  struct CacheStatistics {
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  /* The directory is NANOGCC_CACHE_DIR, XDG_CACHE_HOME/NanoGCC or *
+   * ~/.cache/NanoGCC, the limit is NANOGCC_CACHE_SIZE in bytes.   */
+  bool OpenCompileCache(CompileCache *cache, const char *sourcePath, const char *options);
+  bool FetchFromCache(const CompileCache *cache, const char *filePath);
+  bool   StoreInCache(const CompileCache *cache, const char *filePath);
+  bool TrimCache(const CompileCache *cache);
+  bool GetCacheStatistics(const CompileCache *cache, CacheStatistics *statistics);
+  void DumpCacheStatistics(const CompileCache *cache, FILE *file);
+
+  /* Blobs are smaller entries keyed by the caller, they share *
+   * the directory and the size limit with the ELF files.      */
+  void *FetchCacheBlob(const CompileCache *cache, const char *key, size_t *size);
+  bool  StoreCacheBlob(const CompileCache *cache, const char *key, const void *data, size_t size);
+
+  /* Keys start from the compiler build and the codegen options */
+  CacheHash StartCacheHash(const char *options);
+  CacheHash HashCacheBytes(CacheHash hash, const void *data, size_t size);
+  void FormatCacheKey(CacheHash hash, char *key);
+
+}
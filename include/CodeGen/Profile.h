@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace db {
+
+  /* What the code built with --instrument writes when main returns: *
+   * the header, a counter for every block and every call site and   *
+   * their names, "function:block" and "function:block>callee".      */
+  const uint64_t PROFILE_MAGIC = 0x3146525043474E; /*"NGCPRF1"*/
+  const char PROFILE_BLOCK_SEPARATOR = ':';
+  const char PROFILE_CALL_SEPARATOR  = '>';
+  const size_t PROFILE_NAME_SIZE = 512;
+
+  struct ProfileHeader {
+    uint64_t magic;
+    uint64_t size; /*of the whole file*/
+    uint64_t countersCount;
+  };
+
+  struct ProfileCounter {
+    const char *name;
+    uint64_t count;
+  };
+
+  struct Profile {
+    char *data;
+    size_t size;
+    ProfileCounter *counters; /*sorted by name, the names point into data*/
+    size_t countersCount;
+  };
+
+  bool LoadProfile(Profile *profile, const char *filePath);
+  void DestroyProfile(Profile *profile);
+
+  /* false when the name is not in the profile */
+  bool GetProfileCount(const Profile *profile, const char *name, uint64_t *count);
+  /* Sum of the call sites of the callee */
+  uint64_t GetProfileCallsCount(const Profile *profile, const char *callee);
+
+}
@@ -1,35 +1,128 @@
 #pragma once
 
 #include "Module/Module.h"
+#include "Cache/CompileCache.h"
+#include "CodeGen/Profile.h"
 #include <cstddef>
+#include <cstdint>
 
 namespace db {
 
   typedef unsigned char byte;
 
+  enum PeepholeRule {
+    SelfMove, StoreToLoad, RedundantLoad, DeadStore, MoveChain,
+    PEEPHOLE_RULES_COUNT
+  };
+
+  enum SectionType { RodataSection, DataSection, SECTIONS_COUNT };
+
+  /* Functions and loop heads start at this alignment, *
+   * the text has to be loaded at an aligned address.  */
+  const size_t TEXT_ALIGN = 32;
+
+  /* The rel32 at position points to offset in the section, *
+   * it is counted from nextPosition, the end of the cmd.   */
+  struct Relocation {
+    size_t position;
+    size_t nextPosition;
+    SectionType section;
+    size_t offset;
+  };
+
   struct Area {
     size_t size;
     size_t capacity;
     byte *data;
   };
 
+  /* A function or an entry of the stdlib, name is an offset in symbolNames */
+  struct Symbol {
+    size_t name;
+    size_t offset;
+    size_t size;
+  };
+
+  /* The code of a function and its CFA program in unwindPrograms: *
+   * the DWARF call frame instructions after the ones of the CIE.  */
+  struct Unwind {
+    size_t offset;
+    size_t size;
+    size_t program;
+    size_t programSize;
+  };
+
+  /* Codegen numbers of a function of the module, symbol is its index *
+   * in symbols. Spills are loads and stores of frame slots, fixups    *
+   * are the rel32 of jumps, calls and data patched after emission.    */
+  struct FunctionStatistics {
+    size_t symbol;
+    size_t spills;
+    size_t fixups;
+    bool isReused;
+  };
+
   struct x86Code {
     Area text;
     Area rodata;
     Area data;
+    size_t bssSize; /*zeroed after data when loaded, not stored in the file*/
     struct {
       size_t offset;
       size_t size;
     } stdlib;
     size_t mainOffset;
     struct {
-      size_t writingRodataOffset;
-      size_t writingDataOffset;
-    } references;
+      size_t size;
+      Relocation *data;
+    } relocations;
+    struct {
+      size_t size;
+      size_t capacity;
+      Symbol *data;
+    } symbols;
+    Area symbolNames; /*names that end with a zero, after an empty one as in .strtab*/
+    struct {
+      size_t size;
+      size_t capacity;
+      Unwind *data;
+    } unwinds;
+    Area unwindPrograms;
+    struct {
+      size_t size;
+      size_t capacity;
+      FunctionStatistics *data;
+    } statistics;
+    bool isLoaded; /*by LoadObjectCode, it has no peephole and FMA counts*/
+    size_t peepholeHits[PEEPHOLE_RULES_COUNT];
+    size_t fusedMultiplies; /*adds and subtractions emitted as FMA*/
+    struct {
+      size_t emitted;
+      size_t reused;
+    } functions;
+  };
+
+  /* signature lists the options that change the code, *
+   * function bodies are cached when cache is given.     *
+   * threadsCount 0 uses every core.                     */
+  struct CodeGenOptions {
+    const CompileCache *cache;
+    const char *signature;
+    size_t threadsCount;
+    const char *instrumentPath; /*the profile the code writes, null when not instrumented*/
+    const Profile *profile;     /*counts of an instrumented run, null when not used*/
   };
 
-  x86Code *GenerateX86Code(const Module *theModule);
+  x86Code *GenerateX86Code(const Module *theModule, const CodeGenOptions *options);
+  /* --backend=llvm: the module through the optimizer and the X86 backend *
+   * of LLVM into an object, the object is then loaded by LoadObjectCode. *
+   * The code calls the same stdlib, spills are not counted.              */
+  x86Code *GenerateLLVMCode(const Module *theModule, const CodeGenOptions *options);
+  x86Code *LoadObjectCode(const byte *object, size_t size, const CodeGenOptions *options);
   void DestroyX86Code(x86Code *code);
   bool GenerateELF(const x86Code *code, const char *filePath);
+  bool RunX86Code(const x86Code *code);
+  void ResolveRelocations
+      (const x86Code *code, byte *text, uint64_t textAddress, const uint64_t *sectionAddresses);
 
 }
\ No newline at end of file
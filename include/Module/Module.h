@@ -15,7 +15,13 @@ namespace db {
       SymbolTable symTable;
     };
 
-  Module *GenerateModule(AST *ast);
+  /* isContracted puts the contract flag on the floating point *
+   * operations, a multiply may then be fused with its add.    */
+  struct ModuleOptions {
+    bool isContracted;
+  };
+
+  Module *GenerateModule(AST *ast, const ModuleOptions *options);
   void DestroyModule(Module *theModule);
 
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "CodeGen/x86Code.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+namespace db {
+
+  /* The phases of main in the order they run */
+  enum CompilePhase {
+    ParsePhase, ModulePhase, PrintPhase, CodeGenPhase, ELFPhase,
+    COMPILE_PHASES_COUNT
+  };
+
+  struct PhaseStatistics {
+    timespec wallStart;
+    timespec  cpuStart;
+    uint64_t allocationsStart;
+    uint64_t allocatedBytesStart;
+    double wallTime; /*seconds*/
+    double  cpuTime; /*seconds, of all the threads of the process*/
+    uint64_t allocations;    /*malloc, calloc, realloc and aligned allocation calls*/
+    uint64_t allocatedBytes; /*requested by them*/
+    long peakRss; /*KiB, of the process by the end of the phase*/
+    bool isRun;
+  };
+
+  struct CompileStatistics {
+    PhaseStatistics phases[COMPILE_PHASES_COUNT];
+  };
+
+  /* Allocations are counted from here on, before that they are *
+   * not counted at all. Call it before any thread is started.  */
+  void CountAllocations();
+  void StartPhase(CompileStatistics *statistics, CompilePhase phase);
+  void  StopPhase(CompileStatistics *statistics, CompilePhase phase);
+
+  /* code is null when no code was generated, the ELF came from the cache. *
+   * Instructions are counted in the final text, cached bodies included.   *
+   * Peephole hits and FMAs are counted the same way, code of              *
+   * --backend=llvm has neither.                                           */
+  void DumpTimeReport(const CompileStatistics *statistics, const x86Code *code, FILE *file);
+  void DumpStatisticsJson(const CompileStatistics *statistics, const x86Code *code, FILE *file);
+
+}
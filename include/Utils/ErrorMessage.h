@@ -16,4 +16,22 @@
             "Fail to open \"%s\". File: \"%s\", Line: %d.\n", \
             (FILE_NAME), __FILE__, __LINE__);                 \
     __VA_ARGS__;                                              \
-  } while (false)
\ No newline at end of file
+  } while (false)
+
+#define FAIL_TO_MAP(...)                                   \
+  do                                                       \
+  {                                                        \
+    fprintf(stderr,                                        \
+            "Fail to map code. File: \"%s\", Line: %d.\n", \
+            __FILE__, __LINE__);                           \
+    __VA_ARGS__;                                           \
+  } while (false)
+
+#define FAIL_TO_COMPILE(REASON, ...)                          \
+  do                                                          \
+  {                                                           \
+    fprintf(stderr,                                           \
+            "Fail to compile: %s. File: \"%s\", Line: %d.\n", \
+            (REASON), __FILE__, __LINE__);                    \
+    __VA_ARGS__;                                              \
+  } while (false)
@@ -0,0 +1,255 @@
+/* Compares the math functions of src/CodeGen/StdLibrary.def with glibc libm:   *
+ * TSC cycles per call, the best of several runs over the same random inputs,   *
+ * and the largest error in ULP against the long double functions. Every       *
+ * function is measured on a short range and on one whose magnitudes are        *
+ * spread evenly over the exponents up to 1e300, down to subnormals for sqrt.   *
+ * pow is then checked bit for bit against libm on the special values of C99    *
+ * Annex F.                                                                     *
+ * Build: g++ -O2 source/mathbench.cpp -o mathbench                            */
+#include "../src/CodeGen/StdLibrary.def"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+typedef double (*Unary )(double);
+typedef double (*Binary)(double, double);
+typedef long double (*Reference)(long double, long double);
+
+static const unsigned char SIN [] = { sin_FUNCTION  };
+static const unsigned char COS [] = { cos_FUNCTION  };
+static const unsigned char TAN [] = { tan_FUNCTION  };
+static const unsigned char POW [] = { pow_FUNCTION  };
+static const unsigned char SQRT[] = { sqrt_FUNCTION };
+
+static const int INPUTS_COUNT = 4096;
+static const int RUNS_COUNT   = 50;
+
+static double xs[INPUTS_COUNT];
+static double ys[INPUTS_COUNT];
+
+/* A logarithmic range draws the exponent evenly, min and max are bounds *
+ * of the magnitude and a signed one flips the sign of half the inputs.   */
+struct Range
+{
+  double min, max;
+  bool isLogarithmic;
+  bool isSigned;
+};
+
+struct Function
+{
+  const char *name;
+  const char *range;
+  const unsigned char *code;
+  size_t size;
+  void *libm;
+  Reference reference;
+  Range x;
+  Range y;
+};
+
+static long double SinL (long double x, long double) { return sinl (x); }
+static long double CosL (long double x, long double) { return cosl (x); }
+static long double TanL (long double x, long double) { return tanl (x); }
+static long double SqrtL(long double x, long double) { return sqrtl(x); }
+static long double PowL (long double x, long double y) { return powl(x, y); }
+
+static uint64_t seed = 88172645463325252ULL;
+
+static double Random(double min, double max)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return min + (max - min)*double(seed >> 11)*0x1p-53;
+}
+
+static double Random(const Range *range)
+{
+  if (!range->isLogarithmic)
+    return Random(range->min, range->max);
+
+  double value =
+      exp2(Random(log2(range->min), log2(range->max)));
+  return range->isSigned && Random(0, 1) < 0.5 ? -value : value;
+}
+
+static double GetUlpError(double value, long double reference)
+{
+  double rounded = double(reference);
+  if (isnan(value) || isnan(rounded))
+    return isnan(value) == isnan(rounded) ? 0 : INFINITY;
+  if (isinf(value) || isinf(rounded))
+    return value == rounded ? 0 : INFINITY;
+
+  int exponent = 0;
+  frexp(rounded, &exponent);
+  exponent = exponent - 53 < -1074 ? -1074 : exponent - 53;
+  return double(fabsl(value - reference)/ldexpl(1, exponent));
+}
+
+/* The calls are not inlined: both sides are reached through a pointer */
+static double MeasureCycles(void *function, bool isBinary)
+{
+  uint64_t best = UINT64_MAX;
+  volatile double sink = 0;
+  for (int run = 0; run < RUNS_COUNT; ++run)
+    {
+      double sum = 0;
+      uint64_t start = __rdtsc();
+      if (isBinary)
+        for (int i = 0; i < INPUTS_COUNT; ++i)
+          sum += ((Binary) function)(xs[i], ys[i]);
+      else
+        for (int i = 0; i < INPUTS_COUNT; ++i)
+          sum += ((Unary) function)(xs[i]);
+      uint64_t cycles = __rdtsc() - start;
+      sink = sum;
+      if (cycles < best) best = cycles;
+    }
+  (void) sink;
+
+  return double(best)/INPUTS_COUNT;
+}
+
+static double MeasureError(void *function, bool isBinary, Reference reference)
+{
+  double maxError = 0;
+  for (int i = 0; i < INPUTS_COUNT; ++i)
+    {
+      double value =
+          isBinary ? ((Binary) function)(xs[i], ys[i]) : ((Unary) function)(xs[i]);
+      double error = GetUlpError(value, reference(xs[i], ys[i]));
+      if (error > maxError) maxError = error;
+    }
+
+  return maxError;
+}
+
+/* Annex F fixes the result of pow wherever it is a zero, an infinity, a *
+ * NaN or exact: there it has to be the bits of libm, NaNs being equal.   *
+ * Elsewhere the pairs are only counted into the largest error in ULP.    */
+static int CheckPowSpecialValues(Binary stdPow, Binary libmPow)
+{
+  static const double VALUES[] =
+      {
+        0.0, -0.0, 0.5, -0.5, 1.0, -1.0, 2.0, -2.0, 3.0, -3.0, 0.25, -0.75,
+        0x1p-1074, -0x1p-1074, 0x1p-1022, 1.7976931348623157e308, -1.7976931348623157e308,
+        1e300, -1e300, 0x1p53, -0x1p53, 0x1p53 + 2, INFINITY, -INFINITY, NAN
+      };
+  const int valuesCount = sizeof(VALUES)/sizeof(VALUES[0]);
+
+  int differencesCount = 0;
+  double maxError = 0;
+  for (int i = 0; i < valuesCount; ++i)
+    for (int j = 0; j < valuesCount; ++j)
+      {
+        double x = VALUES[i];
+        double y = VALUES[j];
+        double value     = stdPow (x, y);
+        double reference = libmPow(x, y);
+        long double exact = powl(x, y);
+        if (!isnan(reference) && !isinf(reference) && reference != 0 && exact != reference)
+          {
+            double error = GetUlpError(value, exact);
+            if (error > maxError) maxError = error;
+            continue;
+          }
+        if (isnan(value) && isnan(reference)) continue;
+        if (!memcmp(&value, &reference, sizeof(double))) continue;
+
+        printf("pow(%a, %a) = %a, libm %a\n", x, y, value, reference);
+        ++differencesCount;
+      }
+
+  printf("pow special values: %d of %d differ from libm, max ULP %.3f elsewhere\n",
+         differencesCount, valuesCount*valuesCount, maxError);
+  return differencesCount;
+}
+
+int main()
+{
+  Unary  volatile libmSin  = sin;
+  Unary  volatile libmCos  = cos;
+  Unary  volatile libmTan  = tan;
+  Unary  volatile libmSqrt = sqrt;
+  Binary volatile libmPow  = pow;
+  Function functions[] =
+      {
+        { "sin" , "[-10, 10]"     , SIN , sizeof(SIN ), (void *) libmSin , SinL , { -10, 10 }, {} },
+        { "sin" , "|x| <= 1e300"  , SIN , sizeof(SIN ), (void *) libmSin , SinL ,
+          { 0x1p-1022, 1e300, true, true }, {} },
+        { "cos" , "[-10, 10]"     , COS , sizeof(COS ), (void *) libmCos , CosL , { -10, 10 }, {} },
+        { "cos" , "|x| <= 1e300"  , COS , sizeof(COS ), (void *) libmCos , CosL ,
+          { 0x1p-1022, 1e300, true, true }, {} },
+        { "tan" , "[-10, 10]"     , TAN , sizeof(TAN ), (void *) libmTan , TanL , { -10, 10 }, {} },
+        { "tan" , "|x| <= 1e300"  , TAN , sizeof(TAN ), (void *) libmTan , TanL ,
+          { 0x1p-1022, 1e300, true, true }, {} },
+        { "pow" , "[0, 10]"        , POW , sizeof(POW ), (void *) libmPow , PowL , { 0, 10 }, { -10, 10 } },
+        { "pow" , "x <= 1e300"    , POW , sizeof(POW ), (void *) libmPow , PowL ,
+          { 0x1p-1022, 1e300, true, false }, { 0x1p-20, 16, true, true } },
+        { "sqrt", "[0, 1e6]"      , SQRT, sizeof(SQRT), (void *) libmSqrt, SqrtL, { 0, 1e6 }, {} },
+        { "sqrt", "x <= 1.8e308"  , SQRT, sizeof(SQRT), (void *) libmSqrt, SqrtL,
+          { 0x1p-1074, 1.7976931348623157e308, true, false }, {} },
+      };
+  const int functionsCount = sizeof(functions)/sizeof(functions[0]);
+
+  size_t size = 0;
+  for (int i = 0; i < functionsCount; ++i)
+    size += functions[i].size;
+  unsigned char *memory =
+      (unsigned char *) mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    {
+      perror("mmap");
+      return 1;
+    }
+
+  void *entries[sizeof(functions)/sizeof(functions[0])]{};
+  for (size_t i = 0, offset = 0; i < size_t(functionsCount); ++i)
+    {
+      memcpy(memory + offset, functions[i].code, functions[i].size);
+      entries[i] = memory + offset;
+      offset += functions[i].size;
+    }
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC))
+    {
+      perror("mprotect");
+      return 1;
+    }
+
+  printf("%-6s %-14s %16s %16s %12s %12s\n",
+         "", "range", "cycles/call", "libm cycles/call", "max ULP", "libm max ULP");
+  for (int i = 0; i < functionsCount; ++i)
+    {
+      const Function *function = &functions[i];
+      bool isBinary = function->y.min != function->y.max;
+      for (int j = 0; j < INPUTS_COUNT; ++j)
+        {
+          xs[j] = Random(&function->x);
+          ys[j] = isBinary ? Random(&function->y) : 0;
+        }
+
+      printf("%-6s %-14s %16.1f %16.1f %12.3f %12.3f\n", function->name, function->range,
+             MeasureCycles(entries[i]      , isBinary),
+             MeasureCycles(function->libm, isBinary),
+             MeasureError(entries[i]      , isBinary, function->reference),
+             MeasureError(function->libm, isBinary, function->reference));
+    }
+
+  int differencesCount = 0;
+  for (int i = 0; i < functionsCount; ++i)
+    if (functions[i].code == POW)
+      {
+        differencesCount = CheckPowSpecialValues((Binary) entries[i], libmPow);
+        break;
+      }
+
+  munmap(memory, size);
+  return differencesCount ? 1 : 0;
+}
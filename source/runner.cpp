@@ -1,16 +1,454 @@
+/* Runs compiled programs and reports the median, the median absolute    *
+ * deviation and a 95% confidence interval of the median over N runs,    *
+ * after warmup runs that are not counted. The program is forked and     *
+ * executed directly, with no shell, stdout goes to /dev/null. Cycles,   *
+ * instructions and branch misses of user space are counted with         *
+ * perf_event_open when the kernel lets us, n/a otherwise.               *
+ *   runner [options] program [arguments]                                *
+ *   runner [options] --compiler=NanoGCC --corpus=source/corpus          *
+ * The second form compiles every .std of the directory and runs each.   *
+ * With --backends it is compiled by both backends of the compiler, the  *
+ * llvm/x86 ratio of the wall time and the code size is printed and the  *
+ * outputs of a run are compared byte by byte.                           *
+ * Options: --runs=N (30), --warmup=N (3), --input=FILE for stdin.       *
+ * Build: g++ -O2 source/runner.cpp -o runner                            */
+#include <math.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+enum Metric { WallTime, CpuTime, Cycles, Instructions, BranchMisses, METRICS_COUNT };
+
+static const char *const METRIC_NAMES[] =
+    { "wall, us", "cpu, us", "cycles", "instructions", "branch-misses" };
+static const uint64_t COUNTER_CONFIGS[] =
+    { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES };
+static const int COUNTERS_COUNT = sizeof(COUNTER_CONFIGS)/sizeof(COUNTER_CONFIGS[0]);
+
+static const int DEFAULT_RUNS   = 30;
+static const int DEFAULT_WARMUP = 3;
+static const int MAX_PATH_SIZE  = 4096;
+static const double Z_95 = 1.96;
+static const char *const BACKENDS[] = { "x86", "llvm" };
+static const int BACKENDS_COUNT = sizeof(BACKENDS)/sizeof(BACKENDS[0]);
+
+struct Sample
+{
+  double metrics[METRICS_COUNT];
+  bool hasCounters;
+};
+
+struct Options
+{
+  int runsCount;
+  int warmupCount;
+  const char *input;
+  const char *compiler;
+  const char *corpus;
+  bool isCompared;
+};
+
+static double GetMicroseconds(const timespec *start, const timespec *end)
+{
+  return double(end->tv_sec - start->tv_sec)*1e6 + double(end->tv_nsec - start->tv_nsec)*1e-3;
+}
+
+/* Counts the child from its exec on, it waits for us on a pipe till then */
+static int OpenCounter(pid_t pid, uint64_t config)
+{
+  perf_event_attr attributes{};
+  attributes.size           = sizeof(attributes);
+  attributes.type           = PERF_TYPE_HARDWARE;
+  attributes.config         = config;
+  attributes.disabled       = 1;
+  attributes.enable_on_exec = 1;
+  attributes.inherit        = 1;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv     = 1;
+  attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return int(syscall(SYS_perf_event_open, &attributes, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+/* Scaled up when the counters were multiplexed */
+static bool ReadCounter(int counter, double *value)
+{
+  uint64_t values[3]{}; /*value, time enabled, time running*/
+  if (read(counter, values, sizeof(values)) != sizeof(values) || !values[2]) return false;
+
+  *value = double(values[0])*double(values[1])/double(values[2]);
+  return true;
+}
+
+/* stdout goes to output when it is given */
+static bool RunOnce(char *const argv[], const char *input, const char *output, Sample *sample)
+{
+  int pipeEnds[2]{};
+  if (pipe2(pipeEnds, O_CLOEXEC)) return false;
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (!pid)
+    {
+      close(pipeEnds[1]);
+      char go = 0;
+      if (read(pipeEnds[0], &go, 1) != 1) _exit(127);
+
+      int  inputFile = open(input ? input : "/dev/null", O_RDONLY);
+      int outputFile =
+          output ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open("/dev/null", O_WRONLY);
+      if (inputFile < 0 || outputFile < 0) _exit(127);
+      dup2( inputFile, STDIN_FILENO );
+      dup2(outputFile, STDOUT_FILENO);
+      execv(argv[0], argv);
+      _exit(127);
+    }
+  close(pipeEnds[0]);
+
+  int counters[COUNTERS_COUNT]{};
+  for (int i = 0; i < COUNTERS_COUNT; ++i)
+    counters[i] = OpenCounter(pid, COUNTER_CONFIGS[i]);
+
+  timespec start{}, stop{};
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool isStarted = write(pipeEnds[1], "", 1) == 1;
+  close(pipeEnds[1]);
+
+  int status = 0;
+  rusage usage{};
+  bool isWaited = wait4(pid, &status, 0, &usage) == pid;
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  sample->metrics[WallTime] = GetMicroseconds(&start, &stop);
+  sample->metrics[CpuTime ] =
+      double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1e6 +
+      double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+  sample->hasCounters = true;
+  for (int i = 0; i < COUNTERS_COUNT; ++i)
+    {
+      sample->hasCounters =
+          counters[i] >= 0 && ReadCounter(counters[i], &sample->metrics[Cycles + i]) &&
+          sample->hasCounters;
+      if (counters[i] >= 0) close(counters[i]);
+    }
+
+  if (isWaited && (!WIFEXITED(status) || WEXITSTATUS(status)))
+    fprintf(stderr, "%s exited with status %d\n", argv[0], status);
+  return isStarted && isWaited && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static int CompareDoubles(const void *first, const void *second)
+{
+  double  firstValue = *(const double *)  first;
+  double secondValue = *(const double *) second;
+  return (firstValue > secondValue) - (firstValue < secondValue);
+}
+
+static double GetMedian(const double *sorted, int size)
+{
+  return size % 2 ? sorted[size/2] : (sorted[size/2 - 1] + sorted[size/2])/2;
+}
+
+/* The interval of the median is between two order statistics, *
+ * it does not assume the times are normal.                    */
+static void PrintMetric(const char *name, double *values, int size)
+{
+  qsort(values, size_t(size), sizeof(double), CompareDoubles);
+  double median = GetMedian(values, size);
+
+  double *deviations = (double *) calloc(size_t(size), sizeof(double));
+  if (!deviations) return;
+  for (int i = 0; i < size; ++i) deviations[i] = fabs(values[i] - median);
+  qsort(deviations, size_t(size), sizeof(double), CompareDoubles);
+  double mad = GetMedian(deviations, size);
+  free(deviations);
+
+  int lower = int(floor(size/2.0 - Z_95*sqrt(double(size))/2));
+  int upper = int(ceil (size/2.0 + Z_95*sqrt(double(size))/2));
+  lower = lower < 0 ? 0 : lower;
+  upper = upper > size - 1 ? size - 1 : upper;
+
+  printf("  %-14s %14.1f %12.1f %14.1f %14.1f\n",
+         name, median, mad, values[lower], values[upper]);
+}
+
+/* wallTime gets the median wall time when it is not null */
+static bool Benchmark(const char *name, char *const argv[], const Options *options, double *wallTime)
+{
+  Sample *samples = (Sample *) calloc(size_t(options->runsCount), sizeof(Sample));
+  double *values  = (double *) calloc(size_t(options->runsCount), sizeof(double));
+  if (!samples || !values)
+    {
+      free(samples);
+      free(values);
+      return false;
+    }
+
+  bool isRun = true;
+  Sample warmup{};
+  for (int i = 0; i < options->warmupCount && isRun; ++i)
+    isRun = RunOnce(argv, options->input, nullptr, &warmup);
+  bool hasCounters = true;
+  for (int i = 0; i < options->runsCount && isRun; ++i)
+    {
+      isRun = RunOnce(argv, options->input, nullptr, &samples[i]);
+      hasCounters = hasCounters && samples[i].hasCounters;
+    }
+
+  if (isRun)
+    {
+      printf("%s: %d runs after %d warmup\n"
+             "  %-14s %14s %12s %14s %14s\n",
+             name, options->runsCount, options->warmupCount,
+             "", "median", "MAD", "95% CI low", "95% CI high");
+      for (int metric = 0; metric < METRICS_COUNT; ++metric)
+        {
+          if (metric >= Cycles && !hasCounters)
+            {
+              printf("  %-14s %14s\n", METRIC_NAMES[metric], "n/a");
+              continue;
+            }
+
+          for (int i = 0; i < options->runsCount; ++i)
+            values[i] = samples[i].metrics[metric];
+          PrintMetric(METRIC_NAMES[metric], values, options->runsCount);
+          if (metric == WallTime && wallTime) *wallTime = GetMedian(values, options->runsCount);
+        }
+    }
+  else
+    fprintf(stderr, "%s failed\n", name);
+
+  free(samples);
+  free(values);
+  return isRun;
+}
+
+/* The code size is the sum of the bytes of the functions in --stats=json, *
+ * the stdlib is the same for both backends and is not counted.            */
+static size_t GetCodeSize(const char *statistics)
+{
+  size_t size = 0;
+  for (const char *bytes = strstr(statistics, "\"bytes\":"); bytes;
+       bytes = strstr(bytes + 1, "\"bytes\":"))
+    size += strtoull(bytes + 8, nullptr, 10);
+  return size;
+}
+
+/* backend is null for the default one, codeSize is filled when it is not null */
+static bool Compile
+    (const char *compiler, const char *backend, const char *source, const char *output,
+     size_t *codeSize)
+{
+  int pipeEnds[2]{};
+  if (pipe2(pipeEnds, O_CLOEXEC)) return false;
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (!pid)
+    {
+      int log = open("/dev/null", O_WRONLY);
+      if (log >= 0) dup2(log, STDERR_FILENO);
+      dup2(pipeEnds[1], STDOUT_FILENO);
+
+      char backendOption[MAX_PATH_SIZE]{};
+      snprintf(backendOption, sizeof(backendOption), "--backend=%s", backend ? backend : "");
+      if (backend)
+        execl(compiler, compiler, "--no-cache", "--stats=json", backendOption,
+              source, output, (char *) nullptr);
+      else
+        execl(compiler, compiler, "--no-cache", "--stats=json", source, output, (char *) nullptr);
+      _exit(127);
+    }
+  close(pipeEnds[1]);
+
+  size_t size = 0, capacity = MAX_PATH_SIZE;
+  char *statistics = (char *) calloc(capacity + 1, sizeof(char));
+  for (ssize_t count = 1; statistics && count > 0; )
+    {
+      if (size == capacity)
+        {
+          char *temp = (char *) realloc(statistics, 2*capacity + 1);
+          if (!temp) break;
+          statistics = temp;
+          capacity  *= 2;
+        }
+      count = read(pipeEnds[0], statistics + size, capacity - size);
+      size += count > 0 ? size_t(count) : 0;
+    }
+  close(pipeEnds[0]);
+  if (statistics) statistics[size] = '\0';
+  if (codeSize) *codeSize = statistics ? GetCodeSize(statistics) : 0;
+  free(statistics);
+
+  int status = 0;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static bool IsSameFile(const char *first, const char *second)
+{
+  FILE * firstFile = fopen(first , "rb");
+  FILE *secondFile = fopen(second, "rb");
+  bool isSame = firstFile && secondFile;
+  for (int symbol = 0; isSame && symbol != EOF; )
+    {
+      symbol = fgetc(firstFile);
+      isSame = symbol == fgetc(secondFile);
+    }
+
+  if ( firstFile) fclose( firstFile);
+  if (secondFile) fclose(secondFile);
+  return isSame;
+}
+
+/* Every backend runs the program, then the runs of the last one are compared *
+ * with the first: an optimization that changes the output is a bug of one.   */
+static bool CompareBackends
+    (const char *name, const char *source, const char *temporary, const Options *options)
+{
+  char programs[BACKENDS_COUNT][MAX_PATH_SIZE]{}, outputs[BACKENDS_COUNT][MAX_PATH_SIZE]{};
+  double wallTimes[BACKENDS_COUNT]{};
+  size_t codeSizes[BACKENDS_COUNT]{};
+  bool isCompared = true;
+  for (int i = 0; i < BACKENDS_COUNT && isCompared; ++i)
+    {
+      char title[MAX_PATH_SIZE]{};
+      snprintf(programs[i], sizeof(programs[i]), "%s/%.*s.%s", temporary,
+               int(strlen(name) - 4), name, BACKENDS[i]);
+      snprintf(outputs [i], sizeof(outputs [i]), "%s.out", programs[i]);
+      snprintf(title, sizeof(title), "%s, %s", name, BACKENDS[i]);
+      if (!Compile(options->compiler, BACKENDS[i], source, programs[i], &codeSizes[i]))
+        {
+          fprintf(stderr, "%s does not compile with the %s backend\n", source, BACKENDS[i]);
+          isCompared = false;
+          break;
+        }
+
+      char *argv[] = { programs[i], nullptr };
+      Sample sample{};
+      isCompared =
+          Benchmark(title, argv, options, &wallTimes[i]) &&
+          RunOnce(argv, options->input, outputs[i], &sample);
+    }
+
+  if (isCompared)
+    printf("%s: %s/%s wall %.3f, code %zu/%zu bytes = %.3f, output %s\n", name,
+           BACKENDS[BACKENDS_COUNT - 1], BACKENDS[0],
+           wallTimes[0] > 0 ? wallTimes[BACKENDS_COUNT - 1]/wallTimes[0] : 0.0,
+           codeSizes[BACKENDS_COUNT - 1], codeSizes[0],
+           codeSizes[0] ? double(codeSizes[BACKENDS_COUNT - 1])/double(codeSizes[0]) : 0.0,
+           IsSameFile(outputs[0], outputs[BACKENDS_COUNT - 1]) ? "same" : "DIFFERS");
+
+  for (int i = 0; i < BACKENDS_COUNT; ++i)
+    {
+      unlink(programs[i]);
+      unlink(outputs [i]);
+    }
+  return isCompared;
+}
+
+static int CompareNames(const void *first, const void *second)
+{
+  return strcmp(*(char *const *) first, *(char *const *) second);
+}
+
+/* Compiled programs go to a temporary directory that is removed after */
+static bool BenchmarkCorpus(const Options *options)
+{
+  DIR *directory = opendir(options->corpus);
+  if (!directory)
+    {
+      perror(options->corpus);
+      return false;
+    }
+
+  char *names[256]{};
+  int namesCount = 0;
+  for (dirent *entry = readdir(directory); entry; entry = readdir(directory))
+    {
+      size_t length = strlen(entry->d_name);
+      if (length > 4 && !strcmp(entry->d_name + length - 4, ".std") &&
+          namesCount < int(sizeof(names)/sizeof(names[0])))
+        names[namesCount++] = strdup(entry->d_name);
+    }
+  closedir(directory);
+  qsort(names, size_t(namesCount), sizeof(char *), CompareNames);
+
+  char temporary[] = "/tmp/runnerXXXXXX";
+  bool isBenchmarked = mkdtemp(temporary) != nullptr;
+  for (int i = 0; i < namesCount && isBenchmarked; ++i)
+    {
+      char source[MAX_PATH_SIZE]{}, program[MAX_PATH_SIZE]{};
+      snprintf(source , sizeof(source ), "%s/%s", options->corpus, names[i]);
+      if (options->isCompared)
+        {
+          isBenchmarked = CompareBackends(names[i], source, temporary, options);
+          continue;
+        }
+
+      snprintf(program, sizeof(program), "%s/%.*s", temporary,
+               int(strlen(names[i]) - 4), names[i]);
+      if (!Compile(options->compiler, nullptr, source, program, nullptr))
+        {
+          fprintf(stderr, "%s does not compile\n", source);
+          isBenchmarked = false;
+          break;
+        }
+
+      char *argv[] = { program, nullptr };
+      isBenchmarked = Benchmark(names[i], argv, options, nullptr);
+      unlink(program);
+    }
+
+  rmdir(temporary);
+  for (int i = 0; i < namesCount; ++i) free(names[i]);
+  return isBenchmarked;
+}
+
+static bool ParseCount(const char *argument, const char *option, int *count)
+{
+  size_t length = strlen(option);
+  if (strncmp(argument, option, length)) return false;
+
+  *count = atoi(argument + length);
+  return true;
+}
 
 int main(int argc, char *argv[])
 {
-  timeval stop{}, start{};
-  gettimeofday(&start, nullptr);
-  system(argv[1]);
-  gettimeofday(&stop , nullptr);
-  printf("Time: %ld\n",
-           (stop.tv_sec  - start.tv_sec )*1000000 +
-           (stop.tv_usec - start.tv_usec)*1);
+  Options options{ DEFAULT_RUNS, DEFAULT_WARMUP, nullptr, nullptr, nullptr, false };
+  int i = 1;
+  for ( ; i < argc && !strncmp(argv[i], "--", 2); ++i)
+    {
+      if      (ParseCount(argv[i], "--runs="  , &options.runsCount  )) continue;
+      else if (ParseCount(argv[i], "--warmup=", &options.warmupCount)) continue;
+      else if (!strncmp(argv[i], "--input="   , 8 )) options.input    = argv[i] + 8;
+      else if (!strncmp(argv[i], "--compiler=", 11)) options.compiler = argv[i] + 11;
+      else if (!strncmp(argv[i], "--corpus="  , 9 )) options.corpus   = argv[i] + 9;
+      else if (!strcmp (argv[i], "--backends"     )) options.isCompared = true;
+      else
+        {
+          fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+          return 1;
+        }
+    }
+
+  if (options.runsCount < 1 || options.warmupCount < 0 ||
+      (options.corpus ? !options.compiler : i == argc))
+    {
+      printf("Use %s [--runs=N] [--warmup=N] [--input=FILE] program [arguments]\n"
+             " or %s [--runs=N] [--warmup=N] --compiler=PATH --corpus=DIRECTORY [--backends]\n",
+             argv[0], argv[0]);
+      return 1;
+    }
 
-  return 0;
+  if (options.corpus) return !BenchmarkCorpus(&options);
+  return !Benchmark(argv[i], &argv[i], &options, nullptr);
 }
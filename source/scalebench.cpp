@@ -0,0 +1,488 @@
+/* Measures how NanoGCC scales with the size of its input. Programs are   *
+ * generated from a shape: the count of functions, statements per block,  *
+ * the depth of nested ifs and of nested loops, locals per function and   *
+ * calls per function. Every parameter is swept on its own over a         *
+ * geometric series, the others keep their defaults. Each program is      *
+ * compiled with --no-cache --stats=json, the wall time of every phase    *
+ * and the peak RSS are the medians of the runs. The growth exponent is   *
+ * the slope between the last two points on log-log axes, a super-linear *
+ * one is marked with !.                                                  *
+ *   scalebench --compiler=NanoGCC [--runs=N] [--plot=DIRECTORY]          *
+ *   scalebench --generate [--functions=N] [--statements=N] [--depth=N]   *
+ *              [--loops=N] [--locals=N] [--fanout=N] > program.std       *
+ * --plot writes a .dat file and a gnuplot script for every parameter.    *
+ * The programs compile and end but are not meant to be run: a function   *
+ * calls the fan-out of the ones after it, the running time grows with    *
+ * the fan-out to the power of the function count.                        *
+ * Build: g++ -O2 source/scalebench.cpp -o scalebench                     */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+enum Parameter { Functions, Statements, Depth, Loops, Locals, Fanout, PARAMETERS_COUNT };
+
+static const char *const PARAMETER_NAMES[] =
+    { "functions", "statements", "depth", "loops", "locals", "fanout" };
+static const int DEFAULT_SHAPE[] = { 16, 4, 2, 1, 8, 2 };
+static const int SWEEP_FIRST  [] = { 16, 4, 1, 1, 4, 1 };
+static const int SWEEP_LAST   [] = { 4096, 256, 64, 64, 1024, 64 };
+static const int SWEEP_FACTOR = 4;
+
+static const char *const PHASE_NAMES[] =
+    { "GetAST", "GenerateModule", "PrintModule", "GenerateX86Code", "GenerateELF" };
+static const int PHASES_COUNT = sizeof(PHASE_NAMES)/sizeof(PHASE_NAMES[0]);
+
+static const int DEFAULT_RUNS  = 3;
+static const int MAX_RUNS      = 64;
+static const int MAX_PATH_SIZE = 4096;
+static const int MAX_JSON_SIZE = 1 << 20;
+static const double SUPER_LINEAR_EXPONENT = 1.25;
+
+static const char *const OPERATIONS[] = { "ADD", "SUB", "MUL", "DIV" };
+
+struct Shape
+{
+  int parameters[PARAMETERS_COUNT];
+};
+
+struct Measure
+{
+  double wallTimes[PHASES_COUNT]; /*ms*/
+  double peakRss  [PHASES_COUNT]; /*KiB by the end of the phase*/
+  long sourceSize;
+};
+
+/* Generator. A function is called after its definition only, fK calls *
+ * the ones after it and they are written from the last to f0.          */
+
+struct Generator
+{
+  FILE *file;
+  const Shape *shape;
+  int function;
+  unsigned seed;
+};
+
+static int Random(Generator *generator, int bound)
+{
+  generator->seed = generator->seed*1103515245 + 12345;
+  return int((generator->seed >> 16) % unsigned(bound));
+}
+
+static void WriteLocal(Generator *generator)
+{
+  fprintf(generator->file, "{ \"v%d\" { NIL } { NIL } }",
+          Random(generator, generator->shape->parameters[Locals]));
+}
+
+/* vA = vB op vC */
+static void WriteAssignment(Generator *generator)
+{
+  FILE *file = generator->file;
+  fprintf(file, "{ EQ ");
+  WriteLocal(generator);
+  fprintf(file, " { %s ", OPERATIONS[Random(generator, 4)]);
+  WriteLocal(generator);
+  fprintf(file, " ");
+  WriteLocal(generator);
+  fprintf(file, " } }");
+}
+
+static void WriteBlock(Generator *generator, int size, int depth, int loops);
+
+/* cL = 0; while (cL < 3) { block; cL = cL + 1; }, the counter of the   *
+ * nesting level is declared with the locals. Two statements of the block. */
+static void WriteLoop(Generator *generator, int size, int loops)
+{
+  fprintf(generator->file,
+          "{ EQ { \"c%d\" { NIL } { NIL } } { 0 { NIL } { NIL } } } "
+          "{ ST { WHILE { IS_BT { \"c%d\" { NIL } { NIL } } { 3 { NIL } { NIL } } } "
+          "{ ST { EQ { \"c%d\" { NIL } { NIL } } "
+          "{ ADD { \"c%d\" { NIL } { NIL } } { 1 { NIL } { NIL } } } } ",
+          loops, loops, loops, loops);
+  WriteBlock(generator, size, generator->shape->parameters[Depth], loops + 1);
+  fprintf(generator->file, " } }");
+}
+
+/* Only the then branch nests and only ifs nest in it, loops only nest *
+ * in loops: the size grows linearly with the depth and the loops.     */
+static void WriteIf(Generator *generator, int size, int depth)
+{
+  FILE *file = generator->file;
+  fprintf(file, "{ IF { IS_BT ");
+  WriteLocal(generator);
+  fprintf(file, " ");
+  WriteLocal(generator);
+  fprintf(file, " } { ELSE ");
+  WriteBlock(generator, size, depth + 1, generator->shape->parameters[Loops]);
+  fprintf(file, " { ST ");
+  WriteAssignment(generator);
+  fprintf(file, " { NIL } } } }");
+}
+
+/* Opens a ST for every statement and returns how many to close */
+static int WriteStatements(Generator *generator, int size, int depth, int loops)
+{
+  const int *parameters = generator->shape->parameters;
+  int closings = size;
+  for (int i = 0; i < size; ++i)
+    {
+      fprintf(generator->file, "{ ST ");
+      if (i == 0 && loops < parameters[Loops])
+        {
+          WriteLoop(generator, size, loops);
+          ++closings;
+        }
+      else if (i == 1 && depth < parameters[Depth])
+        WriteIf(generator, size, depth);
+      else
+        WriteAssignment(generator);
+      fprintf(generator->file, " ");
+    }
+
+  return closings;
+}
+
+static void WriteBlock(Generator *generator, int size, int depth, int loops)
+{
+  int closings = WriteStatements(generator, size, depth, loops);
+  fprintf(generator->file, "{ NIL }");
+  for (int i = 0; i < closings; ++i) fprintf(generator->file, " }");
+}
+
+/* fK(a, b): the locals, the calls, the nested block and the sum of two locals */
+static void WriteFunction(Generator *generator)
+{
+  FILE *file = generator->file;
+  const int *parameters = generator->shape->parameters;
+  int function = generator->function;
+
+  fprintf(file, "{ FUNC { \"f%d\" { PARAM { VAR { \"a\" { NIL } { NIL } } { NIL } } "
+                "{ PARAM { VAR { \"b\" { NIL } { NIL } } { NIL } } { NIL } } } "
+                "{ TYPE { NIL } { NIL } } } ",
+          function);
+
+  int statements = 0;
+  for (int i = 0; i < parameters[Locals]; ++i, ++statements)
+    fprintf(file, "{ ST { VAR { \"v%d\" { NIL } { NIL } } "
+                  "{ %s { \"%c\" { NIL } { NIL } } { %d { NIL } { NIL } } } } ",
+            i, OPERATIONS[i % 4], "ab"[i % 2], i + 1);
+
+  for (int i = 0; i < parameters[Loops]; ++i, ++statements)
+    fprintf(file, "{ ST { VAR { \"c%d\" { NIL } { NIL } } { 0 { NIL } { NIL } } } ", i);
+
+  int callees = parameters[Functions] - function - 1;
+  for (int i = 0; callees > 0 && i < parameters[Fanout]; ++i, ++statements)
+    {
+      int local = Random(generator, parameters[Locals]);
+      fprintf(file, "{ ST { EQ { \"v%d\" { NIL } { NIL } } { ADD { \"v%d\" { NIL } { NIL } } "
+                    "{ CALL { \"f%d\" { PARAM ",
+              local, local, function + 1 + i % callees);
+      WriteLocal(generator);
+      fprintf(file, " { PARAM ");
+      WriteLocal(generator);
+      fprintf(file, " { NIL } } } { NIL } } { NIL } } } } ");
+    }
+
+  statements += WriteStatements(generator, parameters[Statements], 0, 0);
+  fprintf(file, "{ ST { RET { ADD ");
+  WriteLocal(generator);
+  fprintf(file, " ");
+  WriteLocal(generator);
+  fprintf(file, " } { NIL } } { NIL } }");
+  for (int i = 0; i < statements; ++i) fprintf(file, " }");
+  fprintf(file, " }");
+}
+
+static void WriteProgram(FILE *file, const Shape *shape)
+{
+  Generator generator{ file, shape, 0, 2463534242u };
+  for (int i = shape->parameters[Functions] - 1; i >= 0; --i)
+    {
+      generator.function = i;
+      fprintf(file, "{ ST ");
+      WriteFunction(&generator);
+      fprintf(file, "\n");
+    }
+
+  fprintf(file, "{ ST { FUNC { \"main\" { NIL } { VOID { NIL } { NIL } } } "
+                "{ ST { OUT { PARAM { CALL { \"f0\" { PARAM { 1 { NIL } { NIL } } "
+                "{ PARAM { 2 { NIL } { NIL } } { NIL } } } { NIL } } { NIL } } { NIL } } "
+                "{ NIL } } { NIL } } } { NIL } }");
+  for (int i = 0; i < shape->parameters[Functions]; ++i) fprintf(file, " }");
+  fprintf(file, "\n");
+}
+
+/* Measurement */
+
+static bool RunCompiler(const char *compiler, const char *source, const char *output, char *json)
+{
+  int pipeEnds[2]{};
+  if (pipe(pipeEnds)) return false;
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (!pid)
+    {
+      FILE *log = fopen("/dev/null", "w");
+      if (log) dup2(fileno(log), STDERR_FILENO);
+      dup2(pipeEnds[1], STDOUT_FILENO);
+      close(pipeEnds[0]);
+      execl(compiler, compiler, "--no-cache", "--stats=json", source, output, (char *) nullptr);
+      _exit(127);
+    }
+  close(pipeEnds[1]);
+
+  size_t size = 0;
+  for (ssize_t count = 1; count > 0 && size < size_t(MAX_JSON_SIZE) - 1; size += size_t(count))
+    {
+      count = read(pipeEnds[0], json + size, size_t(MAX_JSON_SIZE) - 1 - size);
+      if (count <= 0) break;
+    }
+  json[size] = '\0';
+  close(pipeEnds[0]);
+
+  int status = 0;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static double GetJsonNumber(const char *object, const char *key)
+{
+  const char *value = strstr(object, key);
+  return value ? strtod(value + strlen(key), nullptr) : 0;
+}
+
+static void ParsePhases(const char *json, double *wallTimes, double *peakRss)
+{
+  char name[64]{};
+  for (int i = 0; i < PHASES_COUNT; ++i)
+    {
+      snprintf(name, sizeof(name), "{\"name\":\"%s\"", PHASE_NAMES[i]);
+      const char *object = strstr(json, name);
+      wallTimes[i] = object ? GetJsonNumber(object, "\"wall\":")*1e3 : 0;
+      peakRss  [i] = object ? GetJsonNumber(object, "\"peakRss\":")   : 0;
+    }
+}
+
+static int CompareDoubles(const void *first, const void *second)
+{
+  double  firstValue = *(const double *)  first;
+  double secondValue = *(const double *) second;
+  return (firstValue > secondValue) - (firstValue < secondValue);
+}
+
+static double GetMedian(double *values, int size)
+{
+  qsort(values, size_t(size), sizeof(double), CompareDoubles);
+  return size % 2 ? values[size/2] : (values[size/2 - 1] + values[size/2])/2;
+}
+
+static bool MeasureShape
+    (const char *compiler, const char *directory, const Shape *shape, int runsCount, Measure *measure)
+{
+  char source[MAX_PATH_SIZE]{}, output[MAX_PATH_SIZE]{};
+  snprintf(source, sizeof(source), "%s/program.std", directory);
+  snprintf(output, sizeof(output), "%s/program.elf", directory);
+
+  FILE *file = fopen(source, "w");
+  if (!file) return false;
+  WriteProgram(file, shape);
+  measure->sourceSize = ftell(file);
+  fclose(file);
+
+  char *json = (char *) calloc(MAX_JSON_SIZE, 1);
+  if (!json) return false;
+
+  static double wallTimes[PHASES_COUNT][MAX_RUNS];
+  static double peakRss  [PHASES_COUNT][MAX_RUNS];
+  bool isMeasured = true;
+  for (int run = 0; run < runsCount && isMeasured; ++run)
+    {
+      isMeasured = RunCompiler(compiler, source, output, json);
+      double runWallTimes[PHASES_COUNT]{}, runPeakRss[PHASES_COUNT]{};
+      ParsePhases(json, runWallTimes, runPeakRss);
+      for (int i = 0; i < PHASES_COUNT; ++i)
+        {
+          wallTimes[i][run] = runWallTimes[i];
+          peakRss  [i][run] = runPeakRss  [i];
+        }
+    }
+  free(json);
+  unlink(source);
+  unlink(output);
+
+  for (int i = 0; i < PHASES_COUNT && isMeasured; ++i)
+    {
+      measure->wallTimes[i] = GetMedian(wallTimes[i], runsCount);
+      measure->peakRss  [i] = GetMedian(peakRss  [i], runsCount);
+    }
+  return isMeasured;
+}
+
+static void WritePlot(const char *plotDirectory, int parameter, const int *values,
+                      const Measure *measures, int size)
+{
+  const char *name = PARAMETER_NAMES[parameter];
+  char path[MAX_PATH_SIZE]{};
+  snprintf(path, sizeof(path), "%s/%s.dat", plotDirectory, name);
+  FILE *data = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s/%s.gp", plotDirectory, name);
+  FILE *script = fopen(path, "w");
+  if (!data || !script)
+    {
+      if (data  ) fclose(data  );
+      if (script) fclose(script);
+      perror(path);
+      return;
+    }
+
+  fprintf(data, "%s", name); /*the header is the columnhead of gnuplot*/
+  for (int i = 0; i < PHASES_COUNT; ++i) fprintf(data, " %s_ms", PHASE_NAMES[i]);
+  for (int i = 0; i < PHASES_COUNT; ++i) fprintf(data, " %s_rss_kib", PHASE_NAMES[i]);
+  fprintf(data, "\n");
+  for (int point = 0; point < size; ++point)
+    {
+      fprintf(data, "%d", values[point]);
+      for (int i = 0; i < PHASES_COUNT; ++i) fprintf(data, " %.6f", measures[point].wallTimes[i]);
+      for (int i = 0; i < PHASES_COUNT; ++i) fprintf(data, " %.0f"  , measures[point].peakRss  [i]);
+      fprintf(data, "\n");
+    }
+
+  fprintf(script, "set terminal png size 1200,500\n"
+                  "set output '%s.png'\n"
+                  "set multiplot layout 1,2\n"
+                  "set logscale xy\n"
+                  "set xlabel '%s'\n"
+                  "set key left top\n"
+                  "set ylabel 'wall, ms'\n"
+                  "plot for [i=2:%d] '%s.dat' using 1:i with linespoints title columnhead(i)\n"
+                  "set ylabel 'peak RSS, KiB'\n"
+                  "plot for [i=%d:%d] '%s.dat' using 1:i with linespoints title columnhead(i)\n"
+                  "unset multiplot\n",
+          name, name, PHASES_COUNT + 1, name, PHASES_COUNT + 2, 2*PHASES_COUNT + 1, name);
+  fclose(data);
+  fclose(script);
+}
+
+static bool Sweep(const char *compiler, const char *directory, const char *plotDirectory,
+                  int parameter, int runsCount)
+{
+  int values[16]{};
+  Measure measures[16]{};
+  int size = 0;
+
+  printf("%s:\n  %10s %12s", PARAMETER_NAMES[parameter], PARAMETER_NAMES[parameter], "source, KiB");
+  for (int i = 0; i < PHASES_COUNT; ++i) printf(" %16s", PHASE_NAMES[i]);
+  printf(" %14s\n", "peak RSS, KiB");
+
+  for (int value = SWEEP_FIRST[parameter];
+       value <= SWEEP_LAST[parameter] && size < 16; value *= SWEEP_FACTOR)
+    {
+      Shape shape{};
+      memcpy(shape.parameters, DEFAULT_SHAPE, sizeof(shape.parameters));
+      shape.parameters[parameter] = value;
+      if (parameter == Fanout) /*every call site has its own callee at every point*/
+        shape.parameters[Functions] = SWEEP_LAST[Fanout] + 1;
+
+      Measure *measure = &measures[size];
+      if (!MeasureShape(compiler, directory, &shape, runsCount, measure))
+        {
+          fprintf(stderr, "%s=%d does not compile\n", PARAMETER_NAMES[parameter], value);
+          return false;
+        }
+      values[size++] = value;
+
+      printf("  %10d %12ld", value, measure->sourceSize >> 10);
+      for (int i = 0; i < PHASES_COUNT; ++i) printf(" %16.3f", measure->wallTimes[i]);
+      printf(" %14.0f\n", measure->peakRss[PHASES_COUNT - 1]);
+      fflush(stdout);
+    }
+
+  if (size >= 2)
+    {
+      printf("  %10s %12s", "exponent", "");
+      double ratio = log(double(values[size - 1])/values[size - 2]);
+      for (int i = 0; i < PHASES_COUNT; ++i)
+        {
+          double last     = measures[size - 1].wallTimes[i];
+          double previous = measures[size - 2].wallTimes[i];
+          double exponent = last > 0 && previous > 0 ? log(last/previous)/ratio : 0;
+          printf(" %15.2f%c", exponent, exponent > SUPER_LINEAR_EXPONENT ? '!' : ' ');
+        }
+      printf("\n");
+    }
+
+  if (plotDirectory) WritePlot(plotDirectory, parameter, values, measures, size);
+  return true;
+}
+
+static bool ParseParameter(const char *argument, Shape *shape)
+{
+  for (int i = 0; i < PARAMETERS_COUNT; ++i)
+    {
+      size_t length = strlen(PARAMETER_NAMES[i]);
+      if (!strncmp(argument + 2, PARAMETER_NAMES[i], length) && argument[2 + length] == '=')
+        {
+          shape->parameters[i] = atoi(argument + 3 + length);
+          return shape->parameters[i] >= (i == Locals ? 2 : i == Functions);
+        }
+    }
+
+  return false;
+}
+
+int main(int argc, char *argv[])
+{
+  Shape shape{};
+  memcpy(shape.parameters, DEFAULT_SHAPE, sizeof(shape.parameters));
+  const char *compiler = nullptr;
+  const char *plotDirectory = nullptr;
+  int runsCount = DEFAULT_RUNS;
+  bool isGenerated = false;
+  for (int i = 1; i < argc; ++i)
+    {
+      if      (!strcmp (argv[i], "--generate"     )) isGenerated   = true;
+      else if (!strncmp(argv[i], "--compiler=", 11)) compiler      = argv[i] + 11;
+      else if (!strncmp(argv[i], "--plot="    , 7 )) plotDirectory = argv[i] + 7;
+      else if (!strncmp(argv[i], "--runs="    , 7 )) runsCount     = atoi(argv[i] + 7);
+      else if (!ParseParameter(argv[i], &shape))
+        {
+          fprintf(stderr, "Bad option \"%s\".\n", argv[i]);
+          return 1;
+        }
+    }
+
+  if (isGenerated)
+    {
+      WriteProgram(stdout, &shape);
+      return 0;
+    }
+
+  if (!compiler || runsCount < 1 || runsCount > MAX_RUNS)
+    {
+      printf("Use %s --compiler=PATH [--runs=N] [--plot=DIRECTORY]\n"
+             " or %s --generate [--functions=N] [--statements=N] [--depth=N]"
+             " [--loops=N] [--locals=N] [--fanout=N]\n",
+             argv[0], argv[0]);
+      return 1;
+    }
+
+  char directory[] = "/tmp/scalebenchXXXXXX";
+  if (!mkdtemp(directory))
+    {
+      perror("mkdtemp");
+      return 1;
+    }
+  if (plotDirectory) mkdir(plotDirectory, 0755);
+
+  bool isSwept = true;
+  for (int parameter = 0; parameter < PARAMETERS_COUNT && isSwept; ++parameter)
+    isSwept = Sweep(compiler, directory, plotDirectory, parameter, runsCount);
+
+  rmdir(directory);
+  return !isSwept;
+}
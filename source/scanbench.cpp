@@ -0,0 +1,199 @@
+/* Compares scanDouble of src/CodeGen/StdLibrary.def with scanf("%lf"):     *
+ * numbers read per second, the best of several runs over the same text,   *
+ * and the count of values that differ from strtod. scanDouble is measured *
+ * on a regular file, which it maps, and on a pipe, which it reads.        *
+ * Build: g++ -O2 source/scanbench.cpp -o scanbench                        */
+#include "../src/CodeGen/StdLibrary.def"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+typedef double (*Scan)();
+
+struct Entry
+{
+  const char *name;
+  size_t position;
+};
+
+static const unsigned char STDIO[] = { STDIO_FUNCTION };
+static const Entry STDIO_LABELS[] = { STDIO_ENTRIES };
+
+static const int NUMBERS_COUNT = 1 << 20;
+static const int RUNS_COUNT    = 5;
+
+static double expected[NUMBERS_COUNT];
+static double scanned [NUMBERS_COUNT];
+
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t Random()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+/* Shortest and full precision doubles, fixed point and integers */
+static int WriteNumbers(FILE *file)
+{
+  char text[64] = "";
+  for (int i = 0; i < NUMBERS_COUNT; ++i)
+    {
+      uint64_t bits = Random();
+      double value = 0;
+      memcpy(&value, &bits, sizeof(value));
+      if (value != value || value - value != 0) value = double(bits >> 11);
+      switch (i % 4)
+        {
+          case 0: snprintf(text, sizeof(text), "%.17g", value); break;
+          case 1: snprintf(text, sizeof(text), "%.15g", value); break;
+          case 2: snprintf(text, sizeof(text), "%.6f" , double(bits % 2000000) - 1e6); break;
+          case 3: snprintf(text, sizeof(text), "%d"   , int(bits % 100000)); break;
+        }
+      expected[i] = strtod(text, nullptr);
+      fputs(text, file);
+      fputc(i % 8 == 7 ? '\n' : ' ', file);
+    }
+
+  return fflush(file);
+}
+
+static double GetTime()
+{
+  timespec time{};
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return double(time.tv_sec) + double(time.tv_nsec)*1e-9;
+}
+
+static int CountMismatches()
+{
+  int mismatches = 0;
+  for (int i = 0; i < NUMBERS_COUNT; ++i)
+    mismatches += memcmp(&scanned[i], &expected[i], sizeof(double)) != 0;
+
+  return mismatches;
+}
+
+/* The state is zeroed before every run, as it is in a fresh program */
+static double MeasureScanDouble(Scan scan, unsigned char *state, int fd, bool isPipe)
+{
+  memset(state, 0, STDIO_STATE_SIZE);
+  lseek(fd, 0, SEEK_SET);
+
+  pid_t writer = -1;
+  int input = fd;
+  if (isPipe)
+    {
+      int pipeFds[2]{};
+      if (pipe(pipeFds)) return 0;
+      writer = fork();
+      if (writer == 0)
+        {
+          close(pipeFds[0]);
+          char buffer[1 << 16];
+          ssize_t size = 0;
+          while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+            if (write(pipeFds[1], buffer, size_t(size)) != size) _exit(1);
+          _exit(0);
+        }
+      close(pipeFds[1]);
+      input = pipeFds[0];
+    }
+
+  int savedStdin = dup(0);
+  dup2(input, 0);
+  double start = GetTime();
+  for (int i = 0; i < NUMBERS_COUNT; ++i)
+    scanned[i] = scan();
+  double time = GetTime() - start;
+  dup2(savedStdin, 0);
+  close(savedStdin);
+
+  if (isPipe)
+    {
+      close(input);
+      waitpid(writer, nullptr, 0);
+    }
+
+  return NUMBERS_COUNT/time;
+}
+
+static double MeasureScanf(int fd)
+{
+  lseek(fd, 0, SEEK_SET);
+  FILE *file = fdopen(dup(fd), "r");
+  if (!file) return 0;
+
+  double start = GetTime();
+  for (int i = 0; i < NUMBERS_COUNT; ++i)
+    if (fscanf(file, "%lf", &scanned[i]) != 1) break;
+  double time = GetTime() - start;
+
+  fclose(file);
+  return NUMBERS_COUNT/time;
+}
+
+int main()
+{
+  FILE *numbers = tmpfile();
+  if (!numbers || WriteNumbers(numbers))
+    {
+      perror("tmpfile");
+      return 1;
+    }
+  int fd = fileno(numbers);
+
+  /* The code is followed by its state, in reach of lea r11, [rip + state] */
+  size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+  size_t codeSize = (sizeof(STDIO) + pageSize - 1)/pageSize*pageSize;
+  unsigned char *memory =
+      (unsigned char *) mmap(nullptr, codeSize + STDIO_STATE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    {
+      perror("mmap");
+      return 1;
+    }
+
+  unsigned char *state = memory + codeSize;
+  Scan scan = nullptr;
+  memcpy(memory, STDIO, sizeof(STDIO));
+  for (const Entry &entry : STDIO_LABELS)
+    {
+      unsigned char *lea = memory + entry.position;
+      int32_t displacement = int32_t(state - (lea + STATE_LEA_SIZE));
+      memcpy(lea + STATE_LEA_OFFSET, &displacement, sizeof(displacement));
+      if (!strcmp(entry.name, "scanDouble")) scan = (Scan) lea;
+    }
+  if (mprotect(memory, codeSize, PROT_READ | PROT_EXEC))
+    {
+      perror("mprotect");
+      return 1;
+    }
+
+  printf("%-18s %16s %12s\n", "", "numbers/second", "mismatches");
+  const char *names[] = { "scanDouble (file)", "scanDouble (pipe)", "scanf" };
+  for (int i = 0; i < 3; ++i)
+    {
+      double best = 0;
+      for (int run = 0; run < RUNS_COUNT; ++run)
+        {
+          double speed =
+              i < 2 ? MeasureScanDouble(scan, state, fd, i == 1) : MeasureScanf(fd);
+          if (speed > best) best = speed;
+        }
+      printf("%-18s %16.0f %12d\n", names[i], best, CountMismatches());
+    }
+
+  munmap(memory, codeSize + STDIO_STATE_SIZE);
+  fclose(numbers);
+  return 0;
+}
@@ -0,0 +1,455 @@
+#include "Cache/CompileCache.h"
+
+#include "Utils/ErrorMessage.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <link.h>
+#include <unistd.h>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+namespace db {
+
+  /* A rebuilt compiler may emit other code for the same source, the keys *
+   * start from its build ID or, when the linker left none, from the whole *
+   * executable.                                                           */
+  const char COMPILER_PATH[] = "/proc/self/exe";
+  const size_t NOTE_ALIGN = 4;
+
+  const uint64_t DEFAULT_CACHE_SIZE = 256 << 20;
+  const char ENTRY_EXTENSION[] = ".elf";
+  const char  BLOB_EXTENSION[] = ".blob";
+  const char STATISTICS_FILE_NAME[] = "statistics";
+  const size_t COPY_BUFFER_SIZE = 1 << 16;
+
+  /* FNV-1a, 128-bit */
+  typedef CacheHash Hash;
+  const Hash FNV_PRIME  = Hash(1) << 88 | 0x13B;
+  const Hash FNV_OFFSET = Hash(0x6C62272E07BB0142) << 64 | 0x62B821756295C58D;
+
+  struct BuildId {
+    Hash hash;
+    bool isFound;
+  };
+
+  struct CacheEntry {
+    char name[NAME_MAX + 1];
+    uint64_t size;
+    timespec accessTime;
+  };
+
+  static bool GetCachePath
+      (const CompileCache *cache, const char *name, const char *extension, char *path);
+  static bool HashFile(Hash *hash, const char *filePath);
+  static Hash HashCompiler();
+  static int HashBuildId(dl_phdr_info *info, size_t size, void *data);
+  static bool GetCacheDirectory(char *directory);
+  static bool CreateDirectories(char *path);
+  static bool CopyFileAtomically(const char *source, const char *destination, mode_t mode);
+  static bool IsCacheEntry(const char *name);
+  static bool UpdateStatistics(const CompileCache *cache, bool isHit);
+
+  bool OpenCompileCache(CompileCache *cache, const char *sourcePath, const char *options)
+    {
+      assert(cache && sourcePath && options);
+
+      *cache = {};
+      if (!GetCacheDirectory(cache->directory) || !CreateDirectories(cache->directory))
+        return false;
+
+      const char *sizeLimit = getenv("NANOGCC_CACHE_SIZE");
+      cache->sizeLimit =
+          sizeLimit ? strtoull(sizeLimit, nullptr, 10) : DEFAULT_CACHE_SIZE;
+
+      Hash hash = StartCacheHash(options);
+      if (!HashFile(&hash, sourcePath)) return false;
+
+      FormatCacheKey(hash, cache->key);
+      return true;
+    }
+
+  /* Sizes go first so the parts can not run into each other */
+  CacheHash StartCacheHash(const char *options)
+    {
+      assert(options);
+
+      static const Hash compiler = HashCompiler();
+      size_t optionsSize = strlen(options);
+      Hash hash = FNV_OFFSET;
+      hash = HashCacheBytes(hash, &compiler, sizeof(compiler));
+      hash = HashCacheBytes(hash, &optionsSize, sizeof(optionsSize));
+      hash = HashCacheBytes(hash, options, optionsSize);
+      return hash;
+    }
+
+  CacheHash HashCacheBytes(CacheHash hash, const void *data, size_t size)
+    {
+      assert(data || !size);
+
+      const auto *bytes = (const unsigned char *) data;
+      for (size_t i = 0; i < size; ++i)
+        {
+          hash ^= bytes[i];
+          hash *= FNV_PRIME;
+        }
+
+      return hash;
+    }
+
+  void FormatCacheKey(CacheHash hash, char *key)
+    {
+      assert(key);
+      snprintf(key, CACHE_KEY_SIZE + 1, "%016" PRIx64 "%016" PRIx64,
+               uint64_t(hash >> 64), uint64_t(hash));
+    }
+
+  /* A hit copies the cached ELF to filePath and marks the entry as used */
+  bool FetchFromCache(const CompileCache *cache, const char *filePath)
+    {
+      assert(cache && filePath);
+
+      char entryPath[PATH_MAX]{};
+      bool isHit =
+          GetCachePath(cache, cache->key, ENTRY_EXTENSION, entryPath) &&
+          !access(entryPath, R_OK) && CopyFileAtomically(entryPath, filePath, ELF_FILE_MODE);
+      if (isHit) utimensat(AT_FDCWD, entryPath, nullptr, 0);
+
+      UpdateStatistics(cache, isHit);
+      return isHit;
+    }
+
+  bool StoreInCache(const CompileCache *cache, const char *filePath)
+    {
+      assert(cache && filePath);
+
+      char entryPath[PATH_MAX]{};
+      if (!GetCachePath(cache, cache->key, ENTRY_EXTENSION, entryPath) ||
+          !CopyFileAtomically(filePath, entryPath, 0644))
+        return false;
+
+      return TrimCache(cache);
+    }
+
+  void *FetchCacheBlob(const CompileCache *cache, const char *key, size_t *size)
+    {
+      assert(cache && key && size);
+
+      char blobPath[PATH_MAX]{};
+      if (!GetCachePath(cache, key, BLOB_EXTENSION, blobPath)) return nullptr;
+
+      int descriptor = open(blobPath, O_RDONLY);
+      if (descriptor < 0) return nullptr;
+
+      struct stat status{};
+      void *data = nullptr;
+      if (!fstat(descriptor, &status))
+        data = malloc(size_t(status.st_size) ? size_t(status.st_size) : 1);
+      if (data && read(descriptor, data, size_t(status.st_size)) != status.st_size)
+        {
+          free(data);
+          data = nullptr;
+        }
+      close(descriptor);
+      if (!data) return nullptr;
+
+      utimensat(AT_FDCWD, blobPath, nullptr, 0);
+      *size = size_t(status.st_size);
+      return data;
+    }
+
+  bool StoreCacheBlob(const CompileCache *cache, const char *key, const void *data, size_t size)
+    {
+      assert(cache && key && (data || !size));
+
+      char blobPath[PATH_MAX]{};
+      char temporaryPath[PATH_MAX]{};
+      if (!GetCachePath(cache, key, BLOB_EXTENSION, blobPath) ||
+          snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp",
+                   blobPath, int(getpid())) >= PATH_MAX)
+        return false;
+
+      int descriptor = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (descriptor < 0) FAIL_TO_OPEN(temporaryPath, return false);
+
+      bool isWritten = write(descriptor, data, size) == ssize_t(size);
+      isWritten = !close(descriptor) && isWritten;
+      isWritten = isWritten && !rename(temporaryPath, blobPath);
+      if (!isWritten) unlink(temporaryPath);
+
+      return isWritten;
+    }
+
+  bool GetCacheStatistics(const CompileCache *cache, CacheStatistics *statistics)
+    {
+      assert(cache && statistics);
+
+      *statistics = {};
+      char statisticsPath[PATH_MAX]{};
+      if (!GetCachePath(cache, STATISTICS_FILE_NAME, "", statisticsPath)) return false;
+
+      FILE *file = fopen(statisticsPath, "r");
+      if (!file) return errno == ENOENT;
+
+      flock(fileno(file), LOCK_SH);
+      bool isRead =
+          fscanf(file, "%" SCNu64 " %" SCNu64, &statistics->hits, &statistics->misses) == 2;
+      fclose(file);
+      return isRead;
+    }
+
+  void DumpCacheStatistics(const CompileCache *cache, FILE *file)
+    {
+      assert(cache && file);
+
+      CacheStatistics statistics{};
+      GetCacheStatistics(cache, &statistics);
+
+      uint64_t total = statistics.hits + statistics.misses;
+      fprintf(file, "Cache: %s\n"
+                    "  hits   %" PRIu64 "\n"
+                    "  misses %" PRIu64 "\n"
+                    "  ratio  %.1f%%\n",
+              cache->directory, statistics.hits, statistics.misses,
+              total ? 100.0*double(statistics.hits)/double(total) : 0.0);
+    }
+
+  static bool GetCachePath
+      (const CompileCache *cache, const char *name, const char *extension, char *path)
+    {
+      assert(cache && name && extension && path);
+      return snprintf(path, PATH_MAX, "%s/%s%s", cache->directory, name, extension) < PATH_MAX;
+    }
+
+  static bool HashFile(Hash *hash, const char *filePath)
+    {
+      assert(hash && filePath);
+
+      FILE *file = fopen(filePath, "rb");
+      if (!file) FAIL_TO_OPEN(filePath, return false);
+
+      unsigned char buffer[COPY_BUFFER_SIZE];
+      size_t size = 0;
+      while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        *hash = HashCacheBytes(*hash, buffer, size);
+
+      bool isRead = !ferror(file);
+      fclose(file);
+      return isRead;
+    }
+
+  static Hash HashCompiler()
+    {
+      BuildId buildId{ FNV_OFFSET, false };
+      dl_iterate_phdr(HashBuildId, &buildId);
+      if (buildId.isFound) return buildId.hash;
+
+      Hash hash = FNV_OFFSET;
+      HashFile(&hash, COMPILER_PATH);
+      return hash;
+    }
+
+  /* The executable is the first object dl_iterate_phdr reports */
+  static int HashBuildId(dl_phdr_info *info, size_t size, void *data)
+    {
+      assert(info && data);
+      (void) size;
+
+      auto *buildId = (BuildId *) data;
+      for (size_t i = 0; i < info->dlpi_phnum && !buildId->isFound; ++i)
+        {
+          const ElfW(Phdr) *header = &info->dlpi_phdr[i];
+          if (header->p_type != PT_NOTE) continue;
+
+          const auto *note = (const unsigned char *) (info->dlpi_addr + header->p_vaddr);
+          const auto *end  = note + header->p_memsz;
+          while (!buildId->isFound && note + sizeof(ElfW(Nhdr)) <= end)
+            {
+              const auto *noteHeader = (const ElfW(Nhdr) *) note;
+              const unsigned char *name = note + sizeof(ElfW(Nhdr));
+              const unsigned char *description =
+                  name + (noteHeader->n_namesz + NOTE_ALIGN - 1)/NOTE_ALIGN*NOTE_ALIGN;
+              if (description + noteHeader->n_descsz > end) break;
+
+              buildId->isFound =
+                  noteHeader->n_type == NT_GNU_BUILD_ID &&
+                  noteHeader->n_namesz == sizeof(ELF_NOTE_GNU) &&
+                  !memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU));
+              if (buildId->isFound)
+                buildId->hash = HashCacheBytes(buildId->hash, description, noteHeader->n_descsz);
+
+              note = description + (noteHeader->n_descsz + NOTE_ALIGN - 1)/NOTE_ALIGN*NOTE_ALIGN;
+            }
+        }
+
+      return 1;
+    }
+
+  static bool GetCacheDirectory(char *directory)
+    {
+      assert(directory);
+
+      const char *path = getenv("NANOGCC_CACHE_DIR");
+      if (path && *path)
+        return snprintf(directory, PATH_MAX, "%s", path) < PATH_MAX;
+
+      path = getenv("XDG_CACHE_HOME");
+      if (path && *path)
+        return snprintf(directory, PATH_MAX, "%s/NanoGCC", path) < PATH_MAX;
+
+      path = getenv("HOME");
+      if (path && *path)
+        return snprintf(directory, PATH_MAX, "%s/.cache/NanoGCC", path) < PATH_MAX;
+
+      return false;
+    }
+
+  static bool CreateDirectories(char *path)
+    {
+      assert(path);
+
+      for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+        {
+          *slash = '\0';
+          bool isCreated = !mkdir(path, 0755) || errno == EEXIST;
+          *slash = '/';
+          if (!isCreated) return false;
+        }
+
+      return !mkdir(path, 0755) || errno == EEXIST;
+    }
+
+  /* The copy is written next to destination and renamed over it, *
+   * readers see either the old file or the whole new one.        */
+  static bool CopyFileAtomically(const char *source, const char *destination, mode_t mode)
+    {
+      assert(source && destination);
+
+      char temporaryPath[PATH_MAX]{};
+      if (snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.tmp",
+                   destination, int(getpid())) >= PATH_MAX)
+        return false;
+
+      int input = open(source, O_RDONLY);
+      if (input < 0) FAIL_TO_OPEN(source, return false);
+      int output = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, mode);
+      if (output < 0) FAIL_TO_OPEN(temporaryPath, close(input); return false);
+      bool isCopied = !fchmod(output, mode);
+
+      unsigned char buffer[COPY_BUFFER_SIZE];
+      ssize_t size = 0;
+      while (isCopied && (size = read(input, buffer, sizeof(buffer))) > 0)
+        isCopied = write(output, buffer, size_t(size)) == size;
+      isCopied = isCopied && size == 0;
+
+      close(input);
+      isCopied = !close(output) && isCopied;
+      isCopied = isCopied && !rename(temporaryPath, destination);
+      if (!isCopied) unlink(temporaryPath);
+
+      return isCopied;
+    }
+
+  static bool UpdateStatistics(const CompileCache *cache, bool isHit)
+    {
+      assert(cache);
+
+      char statisticsPath[PATH_MAX]{};
+      if (!GetCachePath(cache, STATISTICS_FILE_NAME, "", statisticsPath)) return false;
+
+      int descriptor = open(statisticsPath, O_RDWR | O_CREAT, 0644);
+      if (descriptor < 0) FAIL_TO_OPEN(statisticsPath, return false);
+      flock(descriptor, LOCK_EX);
+
+      char buffer[64]{};
+      ssize_t size = pread(descriptor, buffer, sizeof(buffer) - 1, 0);
+      CacheStatistics statistics{};
+      if (size > 0)
+        sscanf(buffer, "%" SCNu64 " %" SCNu64, &statistics.hits, &statistics.misses);
+      ++(isHit ? statistics.hits : statistics.misses);
+
+      int length =
+          snprintf(buffer, sizeof(buffer), "%" PRIu64 " %" PRIu64 "\n",
+                   statistics.hits, statistics.misses);
+      bool isWritten =
+          !ftruncate(descriptor, 0) && pwrite(descriptor, buffer, size_t(length), 0) == length;
+
+      close(descriptor);
+      return isWritten;
+    }
+
+  static int CompareAccessTimes(const void *first, const void *second)
+    {
+      const timespec *firstTime  = &((const CacheEntry *)  first)->accessTime;
+      const timespec *secondTime = &((const CacheEntry *) second)->accessTime;
+      if (firstTime->tv_sec != secondTime->tv_sec)
+        return (firstTime->tv_sec > secondTime->tv_sec) - (firstTime->tv_sec < secondTime->tv_sec);
+      return (firstTime->tv_nsec > secondTime->tv_nsec) - (firstTime->tv_nsec < secondTime->tv_nsec);
+    }
+
+  static bool IsCacheEntry(const char *name)
+    {
+      assert(name);
+
+      const char *extension = strrchr(name, '.');
+      return extension &&
+             (!strcmp(extension, ENTRY_EXTENSION) || !strcmp(extension, BLOB_EXTENSION));
+    }
+
+  /* Least recently used entries go first until the cache fits the limit, *
+   * a hit refreshes the modification time of its entry.                 */
+  bool TrimCache(const CompileCache *cache)
+    {
+      assert(cache);
+
+      DIR *directory = opendir(cache->directory);
+      if (!directory) FAIL_TO_OPEN(cache->directory, return false);
+
+      CacheEntry *entries = nullptr;
+      size_t size     = 0;
+      size_t capacity = 0;
+      uint64_t totalSize = 0;
+      for (dirent *entry = readdir(directory); entry; entry = readdir(directory))
+        {
+          if (!IsCacheEntry(entry->d_name)) continue;
+
+          struct stat status{};
+          if (fstatat(dirfd(directory), entry->d_name, &status, 0)) continue;
+
+          if (size == capacity)
+            {
+              size_t newCapacity = 2*capacity + 1;
+              auto *temp =
+                  (CacheEntry *) realloc(entries, newCapacity*sizeof(CacheEntry));
+              if (!temp) OUT_OF_MEMORY(free(entries); closedir(directory); return false);
+
+              entries  = temp;
+              capacity = newCapacity;
+            }
+
+          CacheEntry *cacheEntry = &entries[size++];
+          snprintf(cacheEntry->name, sizeof(cacheEntry->name), "%s", entry->d_name);
+          cacheEntry->size       = uint64_t(status.st_size);
+          cacheEntry->accessTime = status.st_mtim;
+          totalSize += cacheEntry->size;
+        }
+
+      if (totalSize > cache->sizeLimit)
+        {
+          qsort(entries, size, sizeof(CacheEntry), CompareAccessTimes);
+          for (size_t i = 0; i < size && totalSize > cache->sizeLimit; ++i)
+            if (!unlinkat(dirfd(directory), entries[i].name, 0) || errno == ENOENT)
+              totalSize -= entries[i].size;
+        }
+
+      free(entries);
+      closedir(directory);
+      return true;
+    }
+
+}
@@ -2,31 +2,87 @@
 
 #include "Utils/ErrorMessage.h"
 
+#include <sys/stat.h>
 #include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
 #include <cassert>
 
 namespace db {
 
-  #define WRITE_INT64(ADR, VALUE) *(int64_t *) (ADR) = (int64_t) (VALUE)
+#include "Dwarf.def"
 
-  const size_t PROGRAM_HEADERS_COUNT  = 4;
+  const size_t PROGRAM_HEADERS_COUNT  = 5;
   const size_t PROGRAM_HEADERS_OFFSET = sizeof(Elf64_Ehdr);
 
   const size_t ENTRY_ADDRESS = 0x400000;
+  const size_t SECTION_ALIGN = 16; /*constant pool is read with 16-byte alignment*/
 
   struct Headers {
     Elf64_Ehdr elfHeader;
     Elf64_Phdr programHeaders[PROGRAM_HEADERS_COUNT];
+    byte padding[-(sizeof(Elf64_Ehdr) + PROGRAM_HEADERS_COUNT*sizeof(Elf64_Phdr)) & (TEXT_ALIGN - 1)];
   };
 
-  enum ProgramHeadersIndex { _text = 0, _stdlib = 1, _rodata = 2, _data = 3 };
+  static_assert(sizeof(Headers) % TEXT_ALIGN == 0, "The text follows the headers");
+
+  enum ProgramHeadersIndex { _text = 0, _stdlib = 1, _rodata = 2, _data = 3, _ehFrameHdr = 4 };
+
+  /* Section headers are not loaded, they follow the data with the  *
+   * symbols, so profilers and debuggers can name the functions.    */
+  enum SectionHeadersIndex {
+    _null, _textSection, _rodataSection, _ehFrameSection, _ehFrameHdrSection,
+    _dataSection, _bssSection, _symtab, _strtab, _shstrtab,
+    SECTION_HEADERS_COUNT
+  };
+
+  const char SECTION_NAMES[] =
+      "\0.text\0.rodata\0.eh_frame\0.eh_frame_hdr\0.data\0.bss\0.symtab\0.strtab\0.shstrtab";
+  const Elf64_Word SECTION_NAME_OFFSETS[SECTION_HEADERS_COUNT] =
+      {
+        /*_null             */ 0 , /*_textSection      */ 1 , /*_rodataSection    */ 7 ,
+        /*_ehFrameSection   */ 15, /*_ehFrameHdrSection*/ 25, /*_dataSection      */ 39,
+        /*_bssSection       */ 45, /*_symtab           */ 50, /*_strtab           */ 58,
+        /*_shstrtab         */ 66,
+      };
+  const size_t TABLE_ALIGN = 8;
+
+  /* .eh_frame and its index .eh_frame_hdr follow the rodata in   *
+   * the same segment. There is one CIE and an FDE for every      *
+   * unwind of the code, the addresses are pc-relative sdata4.    */
+  const byte DW_EH_PE_udata4  = 0x03;
+  const byte DW_EH_PE_sdata4  = 0x0B;
+  const byte DW_EH_PE_pcrel   = 0x10;
+  const byte DW_EH_PE_datarel = 0x30;
+  const byte EH_FRAME_VERSION = 1;
+  const char CIE_AUGMENTATION[] = "zR";
+  const size_t EH_FRAME_ALIGN = 8;
+  /*length, id, version, augmentation, code and data aligns, return address,*
+   *augmentation size and the FDE encoding, all the LEB128 fit in a byte     */
+  const size_t CIE_HEADER_SIZE =
+      2*sizeof(uint32_t) + 1 + sizeof(CIE_AUGMENTATION) + 5;
+  /*length, CIE pointer, pc begin, pc range and augmentation size*/
+  const size_t FDE_HEADER_SIZE = 4*sizeof(uint32_t) + 1;
+  /*version, the three encodings, the frame pointer and the FDEs count*/
+  const size_t EH_FRAME_HDR_HEADER_SIZE = 4 + 2*sizeof(uint32_t);
+
+  static Elf64_Off GetSectionHeadersOffset(const x86Code *code, Elf64_Off offset);
+  static size_t GetEhFrameSize(const x86Code *code);
+  static size_t GetEhFrameHdrSize(const x86Code *code);
+  static byte *CreateEhFrame
+      (const x86Code *code, Elf64_Addr textAddress, Elf64_Addr frameAddress);
+  static bool WriteSections
+      (const x86Code *code, const Headers *headers, Elf64_Off offset, FILE *file);
 
   bool GenerateELF(const x86Code *code, const char *filePath)
     {
       assert(code && filePath);
 
-      FILE *file = fopen(filePath, "wb");
-      if (!file) FAIL_TO_OPEN(filePath, return false);
+      int descriptor = open(filePath, O_WRONLY | O_CREAT | O_TRUNC, ELF_FILE_MODE);
+      FILE *file =
+          descriptor < 0 || fchmod(descriptor, ELF_FILE_MODE) ? nullptr : fdopen(descriptor, "wb");
+      if (!file) FAIL_TO_OPEN(filePath, if (descriptor >= 0) close(descriptor); return false);
 
       uint64_t entryAddress =
           ENTRY_ADDRESS + sizeof(Headers) + code->mainOffset;
@@ -45,8 +101,8 @@ namespace db {
               sizeof(Elf64_Phdr),
               PROGRAM_HEADERS_COUNT,
               sizeof(Elf64_Shdr),
-              0,
-              0
+              SECTION_HEADERS_COUNT,
+              _shstrtab
             }
           };
 
@@ -63,27 +119,276 @@ namespace db {
       headers.programHeaders[_stdlib] =
           { PT_LOAD, PF_R | PF_W | PF_X, offset, address, address, size, size, align };
 
+      uint64_t sectionAddresses[SECTIONS_COUNT]{};
+      Elf64_Xword paddings[SECTIONS_COUNT]{};
+
       offset  += size;
       address += size + align;
-      size = code->rodata.size;
+      paddings[RodataSection] = -offset & (SECTION_ALIGN - 1);
+      offset  += paddings[RodataSection];
+      address += paddings[RodataSection];
+      Elf64_Xword framePadding = -code->rodata.size & (EH_FRAME_ALIGN - 1);
+      Elf64_Addr frameAddress = address + code->rodata.size + framePadding;
+      Elf64_Xword frameSize = GetEhFrameSize(code);
+      Elf64_Xword frameHdrSize = GetEhFrameHdrSize(code);
+      size = code->rodata.size + framePadding + frameSize + frameHdrSize;
       headers.programHeaders[_rodata] =
           { PT_LOAD, PF_R              , offset, address, address, size, size, align };
-      WRITE_INT64(&code->text.data[code->references.writingRodataOffset], address);
+      headers.programHeaders[_ehFrameHdr] =
+          {
+            PT_GNU_EH_FRAME, PF_R, offset + (frameAddress - address) + frameSize,
+            frameAddress + frameSize, frameAddress + frameSize, frameHdrSize, frameHdrSize,
+            sizeof(uint32_t)
+          };
+      sectionAddresses[RodataSection] = address;
 
       offset  += size;
       address += size + align;
+      paddings[DataSection] = -offset & (SECTION_ALIGN - 1);
+      offset  += paddings[DataSection];
+      address += paddings[DataSection];
       size = code->data.size;
       headers.programHeaders[_data] =
-          { PT_LOAD, PF_R | PF_W       , offset, address, address, size, size, align };
-      WRITE_INT64(&code->text.data[code->references.writingDataOffset]  , address);
+          { PT_LOAD, PF_R | PF_W       , offset, address, address, size, size + code->bssSize, align };
+      sectionAddresses[DataSection] = address;
+      headers.elfHeader.e_shoff = GetSectionHeadersOffset(code, offset + size);
 
+      byte *frame = CreateEhFrame(code, ENTRY_ADDRESS + sizeof(Headers), frameAddress);
+      if (!frame) OUT_OF_MEMORY(fclose(file); return false);
+
+      ResolveRelocations(code, code->text.data, ENTRY_ADDRESS + sizeof(Headers), sectionAddresses);
+
+      static const byte PADDING[SECTION_ALIGN] = {};
       fwrite(&headers, sizeof(headers), 1, file);
       fwrite(code->text  .data, code->text  .size, 1, file);
+      fwrite(PADDING, paddings[RodataSection], 1, file);
       fwrite(code->rodata.data, code->rodata.size, 1, file);
+      fwrite(PADDING, framePadding, 1, file);
+      fwrite(frame, frameSize + frameHdrSize, 1, file);
+      free(frame);
+      fwrite(PADDING, paddings[DataSection]  , 1, file);
       fwrite(code->data  .data, code->data  .size, 1, file);
 
-      fclose(file);
-      return true;
+      bool isWritten =
+          WriteSections(code, &headers, offset + size, file);
+      isWritten = !fclose(file) && isWritten;
+      return isWritten;
+    }
+
+  static Elf64_Off GetSectionHeadersOffset(const x86Code *code, Elf64_Off offset)
+    {
+      assert(code);
+
+      offset += -offset & (TABLE_ALIGN - 1);
+      offset += (code->symbols.size + 1)*sizeof(Elf64_Sym) +
+                code->symbolNames.size + sizeof(SECTION_NAMES);
+      return offset + (-offset & (TABLE_ALIGN - 1));
+    }
+
+  /* The symbol table, the names and the section headers, *
+   * offset is where the loaded part of the file ends.    */
+  static bool WriteSections
+      (const x86Code *code, const Headers *headers, Elf64_Off offset, FILE *file)
+    {
+      assert(code && headers && file);
+
+      const Elf64_Phdr *programHeaders = headers->programHeaders;
+      Elf64_Addr textAddress = ENTRY_ADDRESS + sizeof(Headers);
+      Elf64_Xword symtabSize = (code->symbols.size + 1)*sizeof(Elf64_Sym);
+
+      static const byte PADDING[TABLE_ALIGN] = {};
+      Elf64_Xword padding = -offset & (TABLE_ALIGN - 1);
+      fwrite(PADDING, padding, 1, file);
+      offset += padding;
+
+      Elf64_Shdr sections[SECTION_HEADERS_COUNT]{};
+      sections[_textSection] =
+          {
+            SECTION_NAME_OFFSETS[_textSection], SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+            textAddress, sizeof(Headers), code->text.size, 0, 0, TEXT_ALIGN, 0
+          };
+      sections[_rodataSection] =
+          {
+            SECTION_NAME_OFFSETS[_rodataSection], SHT_PROGBITS, SHF_ALLOC,
+            programHeaders[_rodata].p_vaddr, programHeaders[_rodata].p_offset,
+            code->rodata.size, 0, 0, SECTION_ALIGN, 0
+          };
+      Elf64_Addr frameAddress =
+          programHeaders[_ehFrameHdr].p_vaddr - GetEhFrameSize(code);
+      sections[_ehFrameSection] =
+          {
+            SECTION_NAME_OFFSETS[_ehFrameSection], SHT_PROGBITS, SHF_ALLOC,
+            frameAddress, programHeaders[_ehFrameHdr].p_offset - GetEhFrameSize(code),
+            GetEhFrameSize(code), 0, 0, EH_FRAME_ALIGN, 0
+          };
+      sections[_ehFrameHdrSection] =
+          {
+            SECTION_NAME_OFFSETS[_ehFrameHdrSection], SHT_PROGBITS, SHF_ALLOC,
+            programHeaders[_ehFrameHdr].p_vaddr, programHeaders[_ehFrameHdr].p_offset,
+            programHeaders[_ehFrameHdr].p_filesz, 0, 0, sizeof(uint32_t), 0
+          };
+      sections[_dataSection] =
+          {
+            SECTION_NAME_OFFSETS[_dataSection], SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+            programHeaders[_data].p_vaddr, programHeaders[_data].p_offset,
+            code->data.size, 0, 0, SECTION_ALIGN, 0
+          };
+      sections[_bssSection] =
+          {
+            SECTION_NAME_OFFSETS[_bssSection], SHT_NOBITS, SHF_ALLOC | SHF_WRITE,
+            programHeaders[_data].p_vaddr + code->data.size,
+            programHeaders[_data].p_offset + code->data.size,
+            code->bssSize, 0, 0, TABLE_ALIGN, 0
+          };
+      sections[_symtab] =
+          {
+            SECTION_NAME_OFFSETS[_symtab], SHT_SYMTAB, 0, 0, offset, symtabSize,
+            _strtab, 1 /*the first global symbol*/, TABLE_ALIGN, sizeof(Elf64_Sym)
+          };
+      offset += symtabSize;
+      sections[_strtab] =
+          {
+            SECTION_NAME_OFFSETS[_strtab], SHT_STRTAB, 0, 0, offset,
+            code->symbolNames.size, 0, 0, 1, 0
+          };
+      offset += code->symbolNames.size;
+      sections[_shstrtab] =
+          {
+            SECTION_NAME_OFFSETS[_shstrtab], SHT_STRTAB, 0, 0, offset,
+            sizeof(SECTION_NAMES), 0, 0, 1, 0
+          };
+      offset += sizeof(SECTION_NAMES);
+
+      Elf64_Sym symbol{};
+      fwrite(&symbol, sizeof(symbol), 1, file);
+      for (size_t i = 0; i < code->symbols.size; ++i)
+        {
+          const Symbol *codeSymbol = &code->symbols.data[i];
+          symbol =
+              {
+                Elf64_Word(codeSymbol->name), ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), STV_DEFAULT,
+                _textSection, textAddress + codeSymbol->offset, codeSymbol->size
+              };
+          fwrite(&symbol, sizeof(symbol), 1, file);
+        }
+      fwrite(code->symbolNames.data, code->symbolNames.size, 1, file);
+      fwrite(SECTION_NAMES, sizeof(SECTION_NAMES), 1, file);
+
+      padding = -offset & (TABLE_ALIGN - 1);
+      fwrite(PADDING, padding, 1, file);
+      offset += padding;
+
+      assert(offset == headers->elfHeader.e_shoff);
+      fwrite(sections, sizeof(sections), 1, file);
+      return !ferror(file);
+    }
+
+  static size_t GetFdeSize(const Unwind *unwind)
+    {
+      assert(unwind);
+
+      size_t size = FDE_HEADER_SIZE + unwind->programSize;
+      return size + (-size & (EH_FRAME_ALIGN - 1));
+    }
+
+  static size_t GetEhFrameSize(const x86Code *code)
+    {
+      assert(code);
+
+      size_t size = CIE_HEADER_SIZE + sizeof(CIE_INSTRUCTIONS);
+      size += -size & (EH_FRAME_ALIGN - 1);
+      for (size_t i = 0; i < code->unwinds.size; ++i)
+        size += GetFdeSize(&code->unwinds.data[i]);
+      return size + sizeof(uint32_t); /*the zero terminator*/
+    }
+
+  static size_t GetEhFrameHdrSize(const x86Code *code)
+    {
+      assert(code);
+      return EH_FRAME_HDR_HEADER_SIZE + code->unwinds.size*2*sizeof(int32_t);
+    }
+
+  static byte *Put(byte *position, const void *value, size_t size)
+    {
+      assert(position && value);
+
+      memcpy(position, value, size);
+      return position + size;
+    }
+
+  /* .eh_frame with .eh_frame_hdr right after it. The unwinds are *
+   * in the text order, so the search table is sorted as it is.   */
+  static byte *CreateEhFrame
+      (const x86Code *code, Elf64_Addr textAddress, Elf64_Addr frameAddress)
+    {
+      assert(code);
+
+      size_t frameSize = GetEhFrameSize(code);
+      auto *frame =
+          (byte *) calloc(frameSize + GetEhFrameHdrSize(code), sizeof(byte));
+      if (!frame) return nullptr;
+
+      static const byte CIE_FIELDS[] =
+          {
+            EH_FRAME_VERSION, 'z', 'R', '\0', CIE_CODE_ALIGN,
+            byte(CIE_DATA_ALIGN & 0x7F) /*SLEB128*/, DWARF_RETURN_ADDRESS,
+            1 /*augmentation size*/, DW_EH_PE_pcrel | DW_EH_PE_sdata4
+          };
+      static_assert(2*sizeof(uint32_t) + sizeof(CIE_FIELDS) == CIE_HEADER_SIZE,
+                    "The CIE header is counted right");
+
+      size_t cieSize = CIE_HEADER_SIZE + sizeof(CIE_INSTRUCTIONS);
+      cieSize += -cieSize & (EH_FRAME_ALIGN - 1);
+      uint32_t value = uint32_t(cieSize - sizeof(uint32_t));
+      byte *position = Put(frame, &value, sizeof(value));
+      position += sizeof(uint32_t); /*CIE id is zero*/
+      position = Put(position, CIE_FIELDS, sizeof(CIE_FIELDS));
+      Put(position, CIE_INSTRUCTIONS, sizeof(CIE_INSTRUCTIONS));
+      position = frame + cieSize; /*the padding is DW_CFA_nop*/
+
+      byte *hdr = frame + frameSize;
+      Elf64_Addr hdrAddress = frameAddress + frameSize;
+      const byte HDR_ENCODINGS[] =
+          {
+            EH_FRAME_VERSION, DW_EH_PE_pcrel | DW_EH_PE_sdata4,
+            DW_EH_PE_udata4, DW_EH_PE_datarel | DW_EH_PE_sdata4
+          };
+      byte *entry = Put(hdr, HDR_ENCODINGS, sizeof(HDR_ENCODINGS));
+      int32_t address = int32_t(frameAddress - (hdrAddress + sizeof(HDR_ENCODINGS)));
+      entry = Put(entry, &address, sizeof(address));
+      value = uint32_t(code->unwinds.size);
+      entry = Put(entry, &value, sizeof(value));
+
+      for (size_t i = 0; i < code->unwinds.size; ++i)
+        {
+          const Unwind *unwind = &code->unwinds.data[i];
+          assert(!i || unwind->offset >= code->unwinds.data[i - 1].offset);
+
+          Elf64_Addr fdeAddress = frameAddress + size_t(position - frame);
+          Elf64_Addr functionAddress = textAddress + unwind->offset;
+
+          address = int32_t(functionAddress - hdrAddress);
+          entry = Put(entry, &address, sizeof(address));
+          address = int32_t(fdeAddress - hdrAddress);
+          entry = Put(entry, &address, sizeof(address));
+
+          size_t fdeSize = GetFdeSize(unwind);
+          byte *fde = position;
+          value = uint32_t(fdeSize - sizeof(uint32_t));
+          position = Put(position, &value, sizeof(value));
+          value = uint32_t(position - frame); /*back to the CIE*/
+          position = Put(position, &value, sizeof(value));
+          address = int32_t(functionAddress - (fdeAddress + 2*sizeof(uint32_t)));
+          position = Put(position, &address, sizeof(address));
+          value = uint32_t(unwind->size);
+          position = Put(position, &value, sizeof(value));
+          position += 1; /*augmentation size is zero*/
+          if (unwind->programSize)
+            Put(position, code->unwindPrograms.data + unwind->program, unwind->programSize);
+          position = fde + fdeSize;
+        }
+
+      return frame;
     }
 
-}
\ No newline at end of file
+}
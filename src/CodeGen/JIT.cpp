@@ -0,0 +1,128 @@
+#include "CodeGen/x86Code.h"
+
+#include "Utils/ErrorMessage.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+
+namespace db {
+
+  struct Layout {
+    size_t pageSize;
+    size_t textSize;
+    size_t rodataOffset;
+    size_t dataOffset;
+    size_t size;
+  };
+
+  static size_t AlignToPage(size_t size, size_t pageSize)
+    { return (size + pageSize - 1)/pageSize*pageSize; }
+
+  /* text, rodata and data get their own pages of one mapping, *
+   * so every rel32 between them fits.                          */
+  static Layout GetLayout(const x86Code *code)
+    {
+      assert(code);
+
+      Layout layout{};
+      layout.pageSize     = size_t(sysconf(_SC_PAGESIZE));
+      layout.textSize     = AlignToPage(code->text  .size, layout.pageSize);
+      layout.rodataOffset = layout.textSize;
+      layout.dataOffset   =
+          layout.rodataOffset + AlignToPage(code->rodata.size, layout.pageSize);
+      layout.size         =
+          layout.dataOffset   + AlignToPage(code->data  .size + code->bssSize, layout.pageSize);
+      if (!layout.size) layout.size = layout.pageSize;
+
+      return layout;
+    }
+
+  /* Protections follow the segments of GenerateELF, *
+   * the pages of the stdlib stay writable.          */
+  static bool ProtectSections(const x86Code *code, const Layout *layout, byte *memory)
+    {
+      assert(code && layout && memory);
+
+      size_t stdlibPage =
+          code->stdlib.offset/layout->pageSize*layout->pageSize;
+      bool isProtected =
+          !mprotect(memory, stdlibPage, PROT_READ | PROT_EXEC) &&
+          !mprotect(memory + stdlibPage, layout->textSize - stdlibPage,
+                    PROT_READ | PROT_WRITE | PROT_EXEC) &&
+          !mprotect(memory + layout->rodataOffset, layout->dataOffset - layout->rodataOffset,
+                    PROT_READ);
+      if (!isProtected) FAIL_TO_MAP(return false);
+
+      return true;
+    }
+
+  /* perf reads the names of JIT code from /tmp/perf-<pid>.map, *
+   * a line per function: start, size in hex and the name.       */
+  static bool WritePerfMap(const x86Code *code, const byte *text)
+    {
+      assert(code && text);
+
+      char filePath[sizeof("/tmp/perf-.map") + 3*sizeof(pid_t)]{};
+      snprintf(filePath, sizeof(filePath), "/tmp/perf-%d.map", int(getpid()));
+      FILE *file = fopen(filePath, "w");
+      if (!file) FAIL_TO_OPEN(filePath, return false);
+
+      for (size_t i = 0; i < code->symbols.size; ++i)
+        {
+          const Symbol *symbol = &code->symbols.data[i];
+          fprintf(file, "%lx %zx %s\n", (unsigned long) (text + symbol->offset), symbol->size,
+                  (const char *) &code->symbolNames.data[symbol->name]);
+        }
+
+      return !fclose(file);
+    }
+
+  /* Does not return when the code is started: *
+   * main leaves with the exit syscall.        */
+  bool RunX86Code(const x86Code *code)
+    {
+      assert(code);
+
+      Layout layout = GetLayout(code);
+      auto *memory =
+          (byte *) mmap(nullptr, layout.size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) FAIL_TO_MAP(return false);
+
+      memcpy(memory                      , code->text  .data, code->text  .size);
+      memcpy(memory + layout.rodataOffset, code->rodata.data, code->rodata.size);
+      memcpy(memory + layout.dataOffset  , code->data  .data, code->data  .size);
+
+      uint64_t sectionAddresses[SECTIONS_COUNT] =
+          {
+            /*RodataSection*/ uint64_t(memory + layout.rodataOffset),
+            /*DataSection  */ uint64_t(memory + layout.dataOffset  )
+          };
+      ResolveRelocations(code, memory, uint64_t(memory), sectionAddresses);
+
+      if (!ProtectSections(code, &layout, memory))
+        {
+          munmap(memory, layout.size);
+          return false;
+        }
+
+      WritePerfMap(code, memory);
+
+      /* The ELF entry is reached with rsp aligned to 16 and no return address */
+      fflush(nullptr);
+      byte *entry = memory + code->mainOffset;
+      asm volatile
+          (
+            "and $-16, %%rsp\n\t"
+            "jmp *%0"
+            :
+            : "r" (entry)
+            : "memory"
+          );
+      __builtin_unreachable();
+    }
+
+}
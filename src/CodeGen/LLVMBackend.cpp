@@ -0,0 +1,576 @@
+#include "CodeGen/x86Code.h"
+
+#include "Utils/ErrorMessage.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wshadow"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Weffc++"
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#pragma GCC diagnostic ignored "-Wswitch-default"
+#pragma GCC diagnostic ignored "-Wuseless-cast"
+#pragma GCC diagnostic ignored "-Wnon-virtual-dtor"
+#pragma GCC diagnostic ignored "-Wctor-dtor-privacy"
+
+#include <llvm-c/Target.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+#pragma GCC diagnostic pop
+
+#include <cassert>
+
+namespace db {
+
+  const char LLVM_TRIPLE[] = "x86_64-unknown-linux-gnu";
+  const char LLVM_CPU[]    = "haswell"; /*the stdlib uses AVX and FMA as well*/
+  const size_t OBJECT_SIZE = 1 << 16;
+
+  /* Values of the module are variables: loads and stores assign them.   *
+   * The lowering gives each one a stack slot of its own, SROA puts them *
+   * back into registers. values maps the globals, the functions and the *
+   * blocks to the ones of the lowered module.                           */
+  struct Lowering {
+    llvm::Module *module = nullptr;
+    llvm::IRBuilder<> *builder = nullptr;
+    llvm::DenseMap<const llvm::Value *, llvm::Value      *> values;
+    llvm::DenseMap<const llvm::Value *, llvm::AllocaInst *>  slots;
+    llvm::Function *function = nullptr;
+    llvm::FunctionCallee exit;
+    bool isMain = false;
+  };
+
+  static llvm::TargetMachine *CreateTargetMachine();
+  static bool LowerModule(Lowering *lowering, const Module *theModule);
+  static bool LowerGlobals(Lowering *lowering, const llvm::Module *source);
+  static void SetLibraryAttributes(llvm::Function *function);
+  static bool LowerFunction(Lowering *lowering, const llvm::Function *source);
+  static bool LowerInstruction(Lowering *lowering, const llvm::Instruction *inst);
+  static void LowerReturn(Lowering *lowering, llvm::Value *value);
+  static llvm::Value *Read(Lowering *lowering, const llvm::Value *value, llvm::Type *type);
+  static bool Write(Lowering *lowering, const llvm::Value *variable, llvm::Value *value);
+  static llvm::Value *Convert(Lowering *lowering, llvm::Value *value, llvm::Type *type);
+  static void OptimizeModule(llvm::Module *module, llvm::TargetMachine *machine);
+  static bool EmitObject
+      (llvm::Module *module, llvm::TargetMachine *machine, llvm::SmallVectorImpl<char> *object);
+
+  x86Code *GenerateLLVMCode(const Module *theModule, const CodeGenOptions *options)
+    {
+      assert(theModule && options);
+
+      llvm::TargetMachine *machine = CreateTargetMachine();
+      if (!machine) return nullptr;
+
+      llvm::IRBuilder<> builder(*theModule->context);
+      Lowering lowering;
+      lowering.builder = &builder;
+      lowering.module  =
+          new llvm::Module(theModule->theModule->getName(), *theModule->context);
+      lowering.module->setTargetTriple(LLVM_TRIPLE);
+      lowering.module->setDataLayout(machine->createDataLayout());
+
+      x86Code *code = nullptr;
+      llvm::SmallVector<char, OBJECT_SIZE> object;
+      if (LowerModule(&lowering, theModule))
+        {
+          OptimizeModule(lowering.module, machine);
+          if (EmitObject(lowering.module, machine, &object))
+            code = LoadObjectCode((const byte *) object.data(), object.size(), options);
+        }
+
+      delete lowering.module;
+      delete machine;
+      return code;
+    }
+
+  static llvm::TargetMachine *CreateTargetMachine()
+    {
+      LLVMInitializeX86TargetInfo();
+      LLVMInitializeX86Target();
+      LLVMInitializeX86TargetMC();
+      LLVMInitializeX86AsmPrinter();
+
+      std::string error;
+      const llvm::Target *target =
+          llvm::TargetRegistry::lookupTarget(LLVM_TRIPLE, error);
+      if (!target) FAIL_TO_COMPILE(error.c_str(), return nullptr);
+
+      return
+          target->createTargetMachine(LLVM_TRIPLE, LLVM_CPU, "", llvm::TargetOptions{},
+                                      llvm::Reloc::PIC_, llvm::None,
+                                      llvm::CodeGenOpt::Aggressive);
+    }
+
+  static bool LowerModule(Lowering *lowering, const Module *theModule)
+    {
+      assert(lowering && theModule);
+
+      const llvm::Module *source = theModule->theModule;
+      if (!LowerGlobals(lowering, source)) return false;
+
+      /* The stdlib exit takes the status in edi, the module declares it without one */
+      lowering->exit =
+          lowering->module->getOrInsertFunction("exit", lowering->builder->getVoidTy(),
+                                                lowering->builder->getInt32Ty());
+      SetLibraryAttributes(llvm::cast<llvm::Function>(lowering->exit.getCallee()));
+
+      for (const llvm::Function &function : *source)
+        if (function.empty() && function.getName() != "exit")
+          {
+            llvm::Function *declaration =
+                llvm::Function::Create(function.getFunctionType(),
+                                       llvm::Function::ExternalLinkage,
+                                       function.getName(), lowering->module);
+            SetLibraryAttributes(declaration);
+            lowering->values[&function] = declaration;
+          }
+
+      /* Functions are declared first, a call may come before its callee */
+      for (const llvm::Function &function : *source)
+        if (!function.empty())
+          {
+            bool isMain = function.getName() == "main";
+            llvm::Function *lowered =
+                llvm::Function::Create(function.getFunctionType(),
+                                       isMain ?
+                                       llvm::Function::ExternalLinkage :
+                                       llvm::Function::InternalLinkage,
+                                       function.getName(), lowering->module);
+            lowered->addFnAttr(llvm::Attribute::NoUnwind);
+            lowered->addFnAttr(llvm::Attribute::UWTable);
+            lowered->addFnAttr("no-jump-tables", "true"); /*rodata is not relocated*/
+            if (isMain) lowered->addFnAttr("stackrealign"); /*entered with no return address*/
+            lowering->values[&function] = lowered;
+          }
+
+      for (const llvm::Function &function : *source)
+        if (!function.empty() && !LowerFunction(lowering, &function))
+          return false;
+
+      if (llvm::verifyModule(*lowering->module, &llvm::errs()))
+        FAIL_TO_COMPILE("the lowered module is not valid", return false);
+
+      return true;
+    }
+
+  /* Doubles become globals of their own. A string becomes its length *
+   * followed by the characters, as printString reads it.             */
+  static bool LowerGlobals(Lowering *lowering, const llvm::Module *source)
+    {
+      assert(lowering && source);
+
+      llvm::Type *doubleType = lowering->builder->getDoubleTy();
+      llvm::SmallVector<llvm::GlobalValue *, 8> strings;
+      for (const llvm::GlobalVariable &global : source->globals())
+        {
+          if (global.getValueType()->isDoubleTy())
+            {
+              auto *lowered =
+                  new llvm::GlobalVariable(*lowering->module, doubleType, false,
+                                           llvm::GlobalValue::InternalLinkage,
+                                           global.hasInitializer() ?
+                                           const_cast<llvm::Constant *>(global.getInitializer()) :
+                                           llvm::ConstantFP::get(doubleType, 0.0),
+                                           global.getName());
+              lowered->setAlignment(global.getAlign());
+              lowering->values[&global] = lowered;
+              continue;
+            }
+
+          const auto *value =
+              global.hasInitializer() ?
+              llvm::dyn_cast<llvm::ConstantDataArray>(global.getInitializer()) : nullptr;
+          if (!value || !value->isString())
+            FAIL_TO_COMPILE("a global that is neither a double nor a string", return false);
+
+          llvm::StringRef string = value->getAsString();
+          uint64_t length =
+              !string.empty() && !string.back() ? string.size() - 1 : string.size();
+          llvm::StructType *type =
+              llvm::StructType::get(lowering->module->getContext(),
+                                    { lowering->builder->getInt64Ty(), value->getType() },
+                                    true /*packed*/);
+          auto *lowered =
+              new llvm::GlobalVariable(*lowering->module, type, true,
+                                       llvm::GlobalValue::PrivateLinkage,
+                                       llvm::ConstantStruct::get(type,
+                                           { lowering->builder->getInt64(length),
+                                             const_cast<llvm::ConstantDataArray *>(value) }),
+                                       global.getName());
+          lowered->setAlignment(llvm::Align(sizeof(uint64_t)));
+          lowering->values[&global] =
+              llvm::ConstantExpr::getInBoundsGetElementPtr(type, lowered,
+                  llvm::ArrayRef<llvm::Constant *>
+                      {
+                        lowering->builder->getInt32(0),
+                        lowering->builder->getInt32(1),
+                        lowering->builder->getInt32(0)
+                      });
+          strings.push_back(lowered);
+        }
+
+      /* The length is never read by the module, the optimizer *
+       * would split it from the characters otherwise.         */
+      if (!strings.empty()) llvm::appendToCompilerUsed(*lowering->module, strings);
+      return true;
+    }
+
+  /* Math functions of the stdlib are pure, the rest only touch its own *
+   * state. None of them is the one of libc, they are not folded.       */
+  static void SetLibraryAttributes(llvm::Function *function)
+    {
+      assert(function);
+
+      llvm::StringRef name = function->getName();
+      function->setDSOLocal(true);
+      function->addFnAttr(llvm::Attribute::NoUnwind);
+      function->addFnAttr(llvm::Attribute::NoBuiltin);
+      if (name == "exit")
+        function->addFnAttr(llvm::Attribute::NoReturn);
+      else if (name == "printString")
+        function->addFnAttr(llvm::Attribute::InaccessibleMemOrArgMemOnly);
+      else if (name == "printDouble" || name == "scanDouble")
+        function->addFnAttr(llvm::Attribute::InaccessibleMemOnly);
+      else
+        {
+          function->addFnAttr(llvm::Attribute::ReadNone);
+          function->addFnAttr(llvm::Attribute::WillReturn);
+        }
+    }
+
+  static bool LowerFunction(Lowering *lowering, const llvm::Function *source)
+    {
+      assert(lowering && source);
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      lowering->function =
+          llvm::cast<llvm::Function>(lowering->values[source]);
+      lowering->isMain = source->getName() == "main";
+      lowering->slots.clear();
+
+      llvm::LLVMContext &context = lowering->module->getContext();
+      llvm::BasicBlock *entry =
+          llvm::BasicBlock::Create(context, "slots", lowering->function);
+      for (const llvm::BasicBlock &block : *source)
+        lowering->values[&block] =
+            llvm::BasicBlock::Create(context, block.getName(), lowering->function);
+
+      /* Allocas are the variables of the source, they start at zero as the *
+       * other slots do: a variable may be read before it is assigned. An   *
+       * operation on a double global has the type of its pointer.          */
+      builder->SetInsertPoint(entry);
+      for (const llvm::Argument &argument : source->args())
+        {
+          llvm::AllocaInst *slot = builder->CreateAlloca(argument.getType());
+          builder->CreateStore(lowering->function->getArg(argument.getArgNo()), slot);
+          lowering->slots[&argument] = slot;
+        }
+      for (const llvm::BasicBlock &block : *source)
+        for (const llvm::Instruction &inst : block)
+          {
+            if (inst.getType()->isVoidTy()) continue;
+
+            llvm::Type *type =
+                inst.getType()->isPointerTy() ? builder->getDoubleTy() : inst.getType();
+            llvm::AllocaInst *slot = builder->CreateAlloca(type);
+            builder->CreateStore(llvm::Constant::getNullValue(type), slot);
+            lowering->slots[&inst] = slot;
+          }
+      builder->CreateBr(llvm::cast<llvm::BasicBlock>(lowering->values[&source->getEntryBlock()]));
+
+      /* Code after the first terminator of a block is never reached, *
+       * a block with no terminator returns.                          */
+      for (const llvm::BasicBlock &block : *source)
+        {
+          auto *lowered = llvm::cast<llvm::BasicBlock>(lowering->values[&block]);
+          builder->SetInsertPoint(lowered);
+          for (const llvm::Instruction &inst : block)
+            {
+              if (!LowerInstruction(lowering, &inst)) return false;
+              if (inst.isTerminator()) break;
+            }
+          if (!lowered->getTerminator()) LowerReturn(lowering, nullptr);
+        }
+
+      return true;
+    }
+
+  static bool LowerInstruction(Lowering *lowering, const llvm::Instruction *inst)
+    {
+      assert(lowering && inst);
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      llvm::Type *doubleType = builder->getDoubleTy();
+      switch (inst->getOpcode())
+        {
+          case llvm::Instruction::Alloca: return true;
+
+          case llvm::Instruction::Load:
+            return Write(lowering, inst, Read(lowering, inst->getOperand(0), nullptr));
+
+          case llvm::Instruction::Store:
+            return Write(lowering, inst->getOperand(0), Read(lowering, inst->getOperand(1), nullptr));
+
+          case llvm::Instruction::FAdd: case llvm::Instruction::FSub:
+          case llvm::Instruction::FMul: case llvm::Instruction::FDiv:
+            {
+              llvm::Value *first  = Read(lowering, inst->getOperand(0), doubleType);
+              llvm::Value *second = Read(lowering, inst->getOperand(1), doubleType);
+              if (!first || !second) return false;
+
+              llvm::Value *value =
+                  builder->CreateBinOp(llvm::Instruction::BinaryOps(inst->getOpcode()),
+                                       first, second);
+              if (auto *valueInst = llvm::dyn_cast<llvm::Instruction>(value))
+                valueInst->copyFastMathFlags(inst);
+              return Write(lowering, inst, value);
+            }
+
+          case llvm::Instruction::FCmp:
+            {
+              llvm::Value *first  = Read(lowering, inst->getOperand(0), doubleType);
+              llvm::Value *second = Read(lowering, inst->getOperand(1), doubleType);
+              if (!first || !second) return false;
+
+              return
+                  Write(lowering, inst,
+                        builder->CreateFCmp(llvm::cast<llvm::FCmpInst>(inst)->getPredicate(),
+                                            first, second));
+            }
+
+          case llvm::Instruction::Select:
+            {
+              llvm::Value *condition =
+                  Read(lowering, inst->getOperand(0), builder->getInt1Ty());
+              llvm::Type *type = lowering->slots.lookup(inst)->getAllocatedType();
+              llvm::Value *first  = Read(lowering, inst->getOperand(1), type);
+              llvm::Value *second = Read(lowering, inst->getOperand(2), type);
+              if (!condition || !first || !second) return false;
+
+              return Write(lowering, inst, builder->CreateSelect(condition, first, second));
+            }
+
+          case llvm::Instruction::FPToSI:
+            {
+              llvm::Value *value = Read(lowering, inst->getOperand(0), doubleType);
+              if (!value) return false;
+
+              return Write(lowering, inst, builder->CreateFPToSI(value, inst->getType()));
+            }
+
+          case llvm::Instruction::SIToFP:
+            {
+              llvm::Value *value = Read(lowering, inst->getOperand(0), builder->getInt64Ty());
+              if (!value) return false;
+
+              return Write(lowering, inst, builder->CreateSIToFP(value, inst->getType()));
+            }
+
+          case llvm::Instruction::Call:
+            {
+              const auto *callInst = llvm::cast<llvm::CallInst>(inst);
+              auto *callee =
+                  llvm::dyn_cast_or_null<llvm::Function>(
+                      lowering->values.lookup(callInst->getCalledFunction()));
+              if (!callee) FAIL_TO_COMPILE("a call of an unknown function", return false);
+
+              llvm::SmallVector<llvm::Value *, 8> arguments;
+              for (size_t i = 0; i < callInst->arg_size(); ++i)
+                {
+                  llvm::Value *argument =
+                      Read(lowering, callInst->getArgOperand(unsigned(i)),
+                           callee->getFunctionType()->getParamType(unsigned(i)));
+                  if (!argument) return false;
+                  arguments.push_back(argument);
+                }
+
+              llvm::CallInst *call = builder->CreateCall(callee, arguments);
+              return inst->getType()->isVoidTy() || Write(lowering, inst, call);
+            }
+
+          case llvm::Instruction::Br:
+            {
+              const auto *branchInst = llvm::cast<llvm::BranchInst>(inst);
+              auto *thenBlock =
+                  llvm::cast<llvm::BasicBlock>(lowering->values[branchInst->getSuccessor(0)]);
+              if (branchInst->isUnconditional())
+                {
+                  builder->CreateBr(thenBlock);
+                  return true;
+                }
+
+              llvm::Value *condition =
+                  Read(lowering, branchInst->getCondition(), builder->getInt1Ty());
+              if (!condition) return false;
+
+              builder->CreateCondBr(condition, thenBlock,
+                                    llvm::cast<llvm::BasicBlock>(
+                                        lowering->values[branchInst->getSuccessor(1)]));
+              return true;
+            }
+
+          case llvm::Instruction::Ret:
+            {
+              const llvm::Value *returned =
+                  llvm::cast<llvm::ReturnInst>(inst)->getReturnValue();
+              llvm::Value *value =
+                  returned ?
+                  Read(lowering, returned, lowering->function->getReturnType()) : nullptr;
+              if (returned && !value) return false;
+
+              LowerReturn(lowering, value);
+              return true;
+            }
+
+          default:
+            FAIL_TO_COMPILE(inst->getOpcodeName(), return false);
+        }
+    }
+
+  /* main exits as it does in GenerateX86Code, it has no return address */
+  static void LowerReturn(Lowering *lowering, llvm::Value *value)
+    {
+      assert(lowering);
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      llvm::Type *type = lowering->function->getReturnType();
+      if (lowering->isMain)
+        {
+          builder->CreateCall(lowering->exit, { builder->getInt32(0) });
+          builder->CreateUnreachable();
+        }
+      else if (type->isVoidTy())
+        builder->CreateRetVoid();
+      else
+        builder->CreateRet(value ? value : llvm::Constant::getNullValue(type));
+    }
+
+  /* A variable, a double global or a constant, converted to type unless it is null */
+  static llvm::Value *Read(Lowering *lowering, const llvm::Value *value, llvm::Type *type)
+    {
+      assert(lowering && value);
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      llvm::Value *read = nullptr;
+      if (llvm::AllocaInst *slot = lowering->slots.lookup(value))
+        read = builder->CreateLoad(slot->getAllocatedType(), slot);
+      else if (const auto *global =
+                   llvm::dyn_cast<llvm::GlobalVariable>(value->stripPointerCasts()))
+        {
+          read = lowering->values.lookup(global);
+          if (read && global->getValueType()->isDoubleTy())
+            read = builder->CreateLoad(builder->getDoubleTy(), read);
+        }
+      else if (llvm::isa<llvm::ConstantFP>(value) || llvm::isa<llvm::ConstantInt>(value))
+        read = const_cast<llvm::Value *>(value);
+
+      if (!read) FAIL_TO_COMPILE("an operand that is not a variable", return nullptr);
+      return type ? Convert(lowering, read, type) : read;
+    }
+
+  static bool Write(Lowering *lowering, const llvm::Value *variable, llvm::Value *value)
+    {
+      assert(lowering && variable);
+
+      if (!value) return false;
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      if (llvm::AllocaInst *slot = lowering->slots.lookup(variable))
+        {
+          builder->CreateStore(Convert(lowering, value, slot->getAllocatedType()), slot);
+          return true;
+        }
+
+      const auto *global = llvm::dyn_cast<llvm::GlobalVariable>(variable);
+      llvm::Value *lowered = global ? lowering->values.lookup(global) : nullptr;
+      if (!lowered || !global->getValueType()->isDoubleTy())
+        FAIL_TO_COMPILE("an assignment to a value that is not a variable", return false);
+
+      builder->CreateStore(Convert(lowering, value, builder->getDoubleTy()), lowered);
+      return true;
+    }
+
+  /* Doubles, conditions and the integers of mod are one another's values */
+  static llvm::Value *Convert(Lowering *lowering, llvm::Value *value, llvm::Type *type)
+    {
+      assert(lowering && value && type);
+
+      llvm::IRBuilder<> *builder = lowering->builder;
+      llvm::Type *valueType = value->getType();
+      if (valueType == type) return value;
+
+      if (type->isDoubleTy())
+        return
+            valueType->isIntegerTy(1) ?
+            builder->CreateUIToFP(value, type) :
+            builder->CreateSIToFP(value, type);
+
+      if (type->isIntegerTy(1))
+        return
+            valueType->isDoubleTy() ?
+            builder->CreateFCmpUNE(value, llvm::ConstantFP::get(valueType, 0.0)) :
+            builder->CreateICmpNE (value, llvm::ConstantInt::get(valueType, 0));
+
+      return
+          valueType->isDoubleTy() ?
+          builder->CreateFPToSI(value, type) :
+          builder->CreateZExt  (value, type);
+    }
+
+  /* The O2 pipeline of clang. Library calls are not recognized, *
+   * the stdlib is not the one of libc.                          */
+  static void OptimizeModule(llvm::Module *module, llvm::TargetMachine *machine)
+    {
+      assert(module && machine);
+
+      llvm::LoopAnalysisManager     loops;
+      llvm::FunctionAnalysisManager functions;
+      llvm::CGSCCAnalysisManager    sccs;
+      llvm::ModuleAnalysisManager   modules;
+
+      llvm::TargetLibraryInfoImpl library(llvm::Triple(module->getTargetTriple()));
+      library.disableAllFunctions();
+      functions.registerPass([&] { return llvm::TargetLibraryAnalysis(library); });
+
+      llvm::PassBuilder passBuilder(machine);
+      passBuilder.registerModuleAnalyses  (modules  );
+      passBuilder.registerCGSCCAnalyses   (sccs     );
+      passBuilder.registerFunctionAnalyses(functions);
+      passBuilder.registerLoopAnalyses    (loops    );
+      passBuilder.crossRegisterProxies(loops, functions, sccs, modules);
+
+      llvm::ModulePassManager passes =
+          passBuilder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+      passes.run(*module, modules);
+    }
+
+  static bool EmitObject
+      (llvm::Module *module, llvm::TargetMachine *machine, llvm::SmallVectorImpl<char> *object)
+    {
+      assert(module && machine && object);
+
+      llvm::TargetLibraryInfoImpl library(llvm::Triple(module->getTargetTriple()));
+      library.disableAllFunctions();
+
+      llvm::raw_svector_ostream stream(*object);
+      llvm::legacy::PassManager passes;
+      passes.add(new llvm::TargetLibraryInfoWrapperPass(library));
+      if (machine->addPassesToEmitFile(passes, stream, nullptr, llvm::CGFT_ObjectFile))
+        FAIL_TO_COMPILE("the target can not emit an object", return false);
+
+      passes.run(*module);
+      return true;
+    }
+
+}
@@ -0,0 +1,134 @@
+#include "CodeGen/Profile.h"
+
+#include "Utils/ErrorMessage.h"
+#include "Utils/FreeAll.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+namespace db {
+
+  static bool ReadProfileFile(Profile *profile, const char *filePath);
+  static bool ParseProfile(Profile *profile);
+  static int CompareCounters(const void *first, const void *second);
+
+  bool LoadProfile(Profile *profile, const char *filePath)
+    {
+      assert(profile && filePath);
+
+      *profile = {};
+      if (!ReadProfileFile(profile, filePath)) return false;
+      if (!ParseProfile(profile))
+        {
+          fprintf(stderr, "Profile \"%s\" is damaged.\n", filePath);
+          DestroyProfile(profile);
+          return false;
+        }
+
+      qsort(profile->counters, profile->countersCount, sizeof(ProfileCounter), CompareCounters);
+      return true;
+    }
+
+  void DestroyProfile(Profile *profile)
+    {
+      assert(profile);
+      FreeAll(profile->data, profile->counters);
+      *profile = {};
+    }
+
+  bool GetProfileCount(const Profile *profile, const char *name, uint64_t *count)
+    {
+      assert(profile && name && count);
+
+      ProfileCounter key{ name, 0 };
+      auto *counter =
+          (const ProfileCounter *) bsearch(&key, profile->counters, profile->countersCount,
+                                           sizeof(ProfileCounter), CompareCounters);
+      if (!counter) return false;
+
+      *count = counter->count;
+      return true;
+    }
+
+  uint64_t GetProfileCallsCount(const Profile *profile, const char *callee)
+    {
+      assert(profile && callee);
+
+      uint64_t count = 0;
+      for (size_t i = 0; i < profile->countersCount; ++i)
+        {
+          const char *separator = strchr(profile->counters[i].name, PROFILE_CALL_SEPARATOR);
+          if (separator && !strcmp(separator + 1, callee))
+            count += profile->counters[i].count;
+        }
+
+      return count;
+    }
+
+  static bool ReadProfileFile(Profile *profile, const char *filePath)
+    {
+      assert(profile && filePath);
+
+      int descriptor = open(filePath, O_RDONLY);
+      if (descriptor < 0) FAIL_TO_OPEN(filePath, return false);
+
+      struct stat status{};
+      if (!fstat(descriptor, &status))
+        profile->data = (char *) malloc(size_t(status.st_size) + 1);
+      if (!profile->data) OUT_OF_MEMORY(close(descriptor); return false);
+
+      bool isRead = read(descriptor, profile->data, size_t(status.st_size)) == status.st_size;
+      close(descriptor);
+      if (!isRead) FAIL_TO_OPEN(filePath, DestroyProfile(profile); return false);
+
+      profile->size = size_t(status.st_size);
+      profile->data[profile->size] = '\0';
+      return true;
+    }
+
+  /* Counters are read in place, names have to end inside the file */
+  static bool ParseProfile(Profile *profile)
+    {
+      assert(profile);
+
+      ProfileHeader header{};
+      if (profile->size < sizeof(header)) return false;
+      memcpy(&header, profile->data, sizeof(header));
+
+      size_t countersEnd = sizeof(header) + header.countersCount*sizeof(uint64_t);
+      if (header.magic != PROFILE_MAGIC || header.size != profile->size ||
+          header.countersCount > profile->size/sizeof(uint64_t) || countersEnd > profile->size)
+        return false;
+
+      profile->counters =
+          (ProfileCounter *) calloc(header.countersCount + 1, sizeof(ProfileCounter));
+      if (!profile->counters) OUT_OF_MEMORY(return false);
+      profile->countersCount = header.countersCount;
+
+      size_t position = countersEnd;
+      for (size_t i = 0; i < header.countersCount; ++i)
+        {
+          if (position >= profile->size) return false;
+
+          ProfileCounter *counter = &profile->counters[i];
+          memcpy(&counter->count, &profile->data[sizeof(header) + i*sizeof(uint64_t)],
+                 sizeof(counter->count));
+          counter->name = &profile->data[position];
+          position += strlen(counter->name) + 1;
+        }
+
+      return position <= profile->size;
+    }
+
+  static int CompareCounters(const void *first, const void *second)
+    {
+      return strcmp(((const ProfileCounter *)  first)->name,
+                    ((const ProfileCounter *) second)->name);
+    }
+
+}
@@ -3,21 +3,47 @@
 #include "Utils/ErrorMessage.h"
 #include "Utils/FreeAll.h"
 
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wshadow"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Weffc++"
+#pragma GCC diagnostic ignored "-Wconversion"
+#pragma GCC diagnostic ignored "-Wuseless-cast"
+#pragma GCC diagnostic ignored "-Wctor-dtor-privacy"
+
+#include <llvm/ADT/SCCIterator.h>
+#include <llvm/Analysis/CallGraph.h>
+#include <llvm/IR/ValueSymbolTable.h>
+
+#pragma GCC diagnostic pop
+
+#include <elf.h>
 #include <cstring>
 #include <malloc.h>
 #include <cassert>
+#include <atomic>
+#include <thread>
+#include <new>
 
 namespace db {
 
   #define WRITE_INT64(ADR, VALUE) *(int64_t *) (ADR) = (int64_t) (VALUE)
   #define WRITE_INT32(ADR, VALUE) *(int32_t *) (ADR) = (int32_t) (VALUE)
 
-  const size_t MAX_ARGS_COUNT = 6;
-
   static bool Write(x86Code *code, const void *buffer, size_t size);
+  static bool WriteArea(Area *area, const void *buffer, size_t size);
 
   #include "Cmd.def"
+  #include "Dwarf.def"
   #include "x86CodeUtils.cpp.in"
+  #include "x86Peephole.cpp.in"
+  #include "x86FunctionCache.cpp.in"
+  #include "x86BlockLayout.cpp.in"
+  #include "x86ShrinkWrap.cpp.in"
+  #include "x86Clobbers.cpp.in"
+  #include "x86Profile.cpp.in"
+  #include "x86Unwind.cpp.in"
+  #include "x86ObjectLoader.cpp.in"
 
   #define EMITTER(NAME) \
     static bool Emit ## NAME \
@@ -40,107 +66,285 @@ namespace db {
   #define   EmitLoad(CONTEXT, INST, CODE) EmitAssignment(CONTEXT, INST, CODE)
   #define  EmitStore(CONTEXT, INST, CODE) EmitAssignment(CONTEXT, INST, CODE)
 
-  static bool EmitFunction
-      (GlobalContext *globalContext, const llvm::Function *function, x86Code *code);
-  static bool EmitMain
-      (GlobalContext *globalContext, const llvm::Function *function, x86Code *code);
+  static bool CreateRelocations(const GlobalContext *context, x86Code *code);
+  static bool EmitFunctions
+      (FunctionShard *shards, size_t size, size_t threadsCount, const x86Code *code);
+  static bool EmitFunction(FunctionShard *shard, const x86Code *code);
   static bool EmitBasicBlock
-      (Context *context, const llvm::BasicBlock *block, x86Code *code);
-
-  x86Code *GenerateX86Code(const Module *theModule)
+      (Context *context, const BlockLayout *layout, x86Code *code);
+
+  static const llvm::Instruction *GetFusedMultiply(const llvm::Value *value);
+  static bool EmitFusedMultiply
+      (Context *context, const llvm::Instruction *inst,
+       const llvm::Instruction *mulInst, x86Code *code);
+  static bool EmitFusedBr
+      (Context *context, const llvm::BranchInst *branchInst, x86Code *code);
+  static bool EmitJump
+      (Context *context, JumpCondition condition,
+       const llvm::BasicBlock *target, x86Code *code);
+  static bool EmitConditionalJump
+      (Context *context, JumpCondition condition,
+       const llvm::BasicBlock *thenBlock, const llvm::BasicBlock *elseBlock, x86Code *code);
+
+  x86Code *GenerateX86Code(const Module *theModule, const CodeGenOptions *options)
     {
-      assert(theModule);
+      assert(theModule && options);
 
       auto *code =
           (x86Code *) calloc(1, sizeof(x86Code));
       if (!code) OUT_OF_MEMORY(return nullptr);
 
       GlobalContext context{};
-      CreateGlobalContext(&context, theModule, code);
+      CreateGlobalContext(&context, theModule, options, code);
+      CreateClobbers(&context, theModule);
 
+      size_t size = 0;
+      auto *shards =
+          (FunctionShard *) calloc(theModule->theModule->size() + 1, sizeof(FunctionShard));
+      if (!shards) OUT_OF_MEMORY(DestroyGlobalContext(&context); free(code); return nullptr);
       for (const llvm::Function &function : *theModule->theModule)
-        EmitFunction(&context, &function, code);
+        if (!function.empty())
+          CreateShard(&shards[size++], &context, &function);
+      CreateProfileImage(&context, shards, size, code);
+
+      EmitFunctions(shards, size, options->threadsCount, code);
+      size_t *order = CreateCommitOrder(&context, shards, size);
+      for (size_t i = 0; i < size && order; ++i)
+        {
+          FunctionShard *shard = &shards[order[i]];
+          CommitFunction(&context, shard, code);
+          ++(shard->isReused ? code->functions.reused : code->functions.emitted);
+        }
+      for (size_t i = 0; i < size; ++i) DestroyShard(&shards[i]);
+      FreeAll(shards, order);
       EmitStdLibrary(&context, code);
 
       UpdateCallReferences(&context, code);
-      code->references =
-          {
-            context.references.writingRodataOffset,
-            context.references.writingDataOffset
-          };
+      CreateRelocations(&context, code);
+      memcpy(code->peepholeHits, context.peepholeHits, sizeof(code->peepholeHits));
+      code->fusedMultiplies = context.fusedMultiplies;
+
+      DestroyGlobalContext(&context);
+      return code;
+    }
 
+  /* The sections of the object are laid out as the code of the module, *
+   * its calls of the stdlib are linked to the one of GenerateX86Code.  */
+  x86Code *LoadObjectCode(const byte *object, size_t size, const CodeGenOptions *options)
+    {
+      assert(object && options);
+
+      auto *code =
+          (x86Code *) calloc(1, sizeof(x86Code));
+      if (!code) OUT_OF_MEMORY(return nullptr);
+
+      GlobalContext context{};
+      context.options = options;
+      ObjectFile file{};
+      bool isLoaded =
+          OpenObjectFile(&file, object, size) &&
+          PlaceObjectSections(&file, code) &&
+          RelocateObjectText(&file, &context, code) &&
+          PushObjectFunctions(&file, &context, code) &&
+          PushObjectUnwinds(&file, code) &&
+          EmitStdLibrary(&context, code) &&
+          FindCallLabels(&context) &&
+          UpdateCallReferences(&context, code) &&
+          CreateRelocations(&context, code);
+
+      DestroyObjectFile(&file);
       DestroyGlobalContext(&context);
+      if (!isLoaded)
+        {
+          DestroyX86Code(code);
+          free(code);
+          return nullptr;
+        }
+
+      code->isLoaded = true;
       return code;
     }
 
   void DestroyX86Code(x86Code *code)
     {
       assert(code);
-      FreeAll(code->text.data, code->data.data, code->rodata.data);
+      FreeAll(code->text.data, code->data.data, code->rodata.data, code->relocations.data,
+              code->symbols.data, code->symbolNames.data,
+              code->unwinds.data, code->unwindPrograms.data, code->statistics.data);
       *code = {};
     }
 
-  static bool EmitFunction
-      (GlobalContext *globalContext, const llvm::Function *function, x86Code *code)
+  /* text is where the code is placed at textAddress, *
+   * rip points to the end of the cmd reading a rel32. */
+  void ResolveRelocations
+      (const x86Code *code, byte *text, uint64_t textAddress, const uint64_t *sectionAddresses)
     {
-      assert(globalContext && function && code);
-      if (function->empty()) return true;
+      assert(code && text && sectionAddresses);
 
-      if (!strcmp("main", function->getName().data()))
-        return EmitMain(globalContext, function, code);
+      for (size_t i = 0; i < code->relocations.size; ++i)
+        {
+          const Relocation *relocation = &code->relocations.data[i];
+          int64_t displacement =
+              int64_t(sectionAddresses[relocation->section] + relocation->offset) -
+              int64_t(textAddress + relocation->nextPosition);
+          WRITE_INT32(&text[relocation->position], displacement);
+        }
+    }
 
-      Context context{};
-      CreateContext(&context, function);
-      PushUsingRegisters(&context, function, code);
-      for (const llvm::BasicBlock &block : *function)
-        EmitBasicBlock(&context, &block, code);
+  static bool CreateRelocations(const GlobalContext *context, x86Code *code)
+    {
+      assert(context && code);
+
+      size_t size = context->dataRefTable.size;
+      code->relocations.data =
+          (Relocation *) calloc(size ? size : 1, sizeof(Relocation));
+      if (!code->relocations.data) OUT_OF_MEMORY(return false);
+      code->relocations.size = size;
+
+      for (size_t i = 0; i < size; ++i)
+        {
+          const DataReference *reference = &context->dataRefTable.data[i];
+          code->relocations.data[i] =
+              {
+                reference->referencePosition,
+                reference->cmdPosition + reference->cmdSize,
+                reference->section,
+                reference->offset
+              };
+        }
 
       return true;
     }
 
-  static bool EmitMain
-      (GlobalContext *globalContext, const llvm::Function *function, x86Code *code)
+  /* Workers take the next shard until none is left. The shards only *
+   * read the module and the code, CommitFunction joins them later.    */
+  static bool EmitFunctions
+      (FunctionShard *shards, size_t size, size_t threadsCount, const x86Code *code)
+    {
+      assert((shards || !size) && code);
+
+      if (!threadsCount) threadsCount = std::thread::hardware_concurrency();
+      if (threadsCount > size) threadsCount = size;
+
+      std::atomic<size_t> next{ 0 };
+      std::atomic<bool>   isEmitted{ true };
+      auto worker =
+          [&]()
+            {
+              for (size_t i = next++; i < size; i = next++)
+                if (!EmitFunction(&shards[i], code)) isEmitted = false;
+            };
+
+      if (threadsCount <= 1)
+        {
+          worker();
+          return isEmitted;
+        }
+
+      auto *threads = new (std::nothrow) std::thread[threadsCount];
+      if (!threads) OUT_OF_MEMORY(return false);
+
+      for (size_t i = 0; i < threadsCount; ++i) threads[i] = std::thread(worker);
+      for (size_t i = 0; i < threadsCount; ++i) threads[i].join();
+
+      delete[] threads;
+      return isEmitted;
+    }
+
+  /* Cached bodies are taken as they are, the others *
+   * are emitted and stored to the cache.            */
+  static bool EmitFunction(FunctionShard *shard, const x86Code *code)
     {
-      assert(globalContext && function && code);
+      assert(shard && code);
 
-      globalContext->references.writingRodataOffset =
-          code->text.size + MOVABS_OFFSET;
-      Write(code, MOVABS_R15, sizeof(MOVABS_R15));
-      globalContext->references.writingDataOffset   =
-          code->text.size + MOVABS_OFFSET;
-      Write(code, MOVABS_R14, sizeof(MOVABS_R14));
+      GlobalContext *globalContext = &shard->context;
+      const CompileCache *cache = globalContext->options->cache;
+      char key[CACHE_KEY_SIZE + 1]{};
+      if (cache)
+        {
+          FormatCacheKey(HashFunction(globalContext, shard->function), key);
+          shard->isReused = LoadFunction(shard, key, code);
+          if (shard->isReused) return true;
+        }
 
       Context context{};
-      CreateContext(&context, function);
-      context.status.inMain = true;
-      for (const llvm::BasicBlock &block : *function)
-        EmitBasicBlock(&context, &block, code);
+      CreateContext(&context, shard);
+
+      x86Code *body = &shard->body;
+      if (context.blockFrames[0] != Frameless) PushUsingRegisters(&context, body);
+      SaveCalleeRegisters(&context, body, true);
+      StoreArguments(&context, shard->function, body);
+      for (size_t i = 0; i < context.blocksCount; ++i)
+        EmitBasicBlock(&context, &context.layout[i], body);
+
+      RunPeephole(&context, body);
+      CollectDataReferences(&context);
+      UpdateJumpReferences(&context, body);
+      CreateUnwindProgram(&context, body);
+      CountFunctionStatistics(&context, shard);
+      if (cache) StoreFunction(&context, shard, key, code);
+      DestroyContext(&context);
 
       return true;
     }
 
+  /* A loop head is preceded by the padding of the largest size, *
+   * UpdateJumpReferences shrinks it to what aligns the head.    */
   static bool EmitBasicBlock
-      (Context *context, const llvm::BasicBlock *block, x86Code *code)
+      (Context *context, const BlockLayout *layout, x86Code *code)
     {
-      assert(context && block && code);
+      assert(context && layout && code);
+
+      const llvm::BasicBlock *block = layout->block;
+      if (layout->isLoopHead)
+        {
+          Reference ref =
+              { code->text.size, code->text.size, TEXT_ALIGN - 1, block->getName().data(), align };
+          PushJumpReference(context, &ref);
+
+          byte padding[TEXT_ALIGN]{};
+          Write(code, padding, WriteNops(padding, TEXT_ALIGN - 1));
+        }
+
+      Label label{ block->getName().data(), code->text.size };
+      PushJumpLabel(context, &label);
+      context->blockIndex = layout->index;
+      context->frame.isSet = context->blockFrames[layout->index] == Framed;
+      FrameEvent frame{ context->frame.isSet ? FramedBlock : FramelessBlock, code->text.size };
+      PushFrameEvent(context, &frame);
+      if (context->blockFrames[layout->index] == FrameSetup) PushUsingRegisters(context, code);
+      context->nextBlock =
+          layout + 1 < context->layout + context->blocksCount ? layout[1].block : nullptr;
+      if (context->counters)
+        context->nextCounter = context->counters[layout->index];
+
+      context->instruction = nullptr;
+      EmitCounter(context, code);
+      LoadBlockVariables(context, code);
 
       for (const llvm::Instruction &inst : *block)
-        switch (inst.getOpcode())
         {
-          #define CASE(TYPE)                         \
-            case llvm::Instruction::TYPE:            \
-              {                                      \
-                Emit ## TYPE (context, &inst, code); \
-              } break
-
-          CASE(FAdd ); CASE(FSub );
-          CASE(FMul ); CASE(FDiv );
-          CASE(And  ); CASE(Or   );
-          CASE(FCmp ); CASE(Load );
-          CASE(Store); CASE(Call );
-          CASE(Br   ); CASE(Ret  );
+          context->instruction = &inst;
+          if (inst.isTerminator()) StoreBlockVariables(context, code);
 
-          #undef CASE
+          switch (inst.getOpcode())
+            {
+              #define CASE(TYPE)                         \
+                case llvm::Instruction::TYPE:            \
+                  {                                      \
+                    Emit ## TYPE (context, &inst, code); \
+                  } break
+
+              CASE(FAdd ); CASE(FSub );
+              CASE(FMul ); CASE(FDiv );
+              CASE(And  ); CASE(Or   );
+              CASE(FCmp ); CASE(Load );
+              CASE(Store); CASE(Call );
+              CASE(Br   ); CASE(Ret  );
+
+              #undef CASE
+            }
+          if (inst.isTerminator()) break;
         }
 
       return true;
@@ -151,6 +355,10 @@ namespace db {
     {
       assert(context && inst && code);
 
+      if (IsFusedMultiply(inst)) return true;
+      if (const llvm::Instruction *mulInst = GetFusedMultiply(inst))
+        return EmitFusedMultiply(context, inst, mulInst, code);
+
       size_t opcodeIndex = 0;
       switch (inst->getOpcode())
         {
@@ -166,29 +374,126 @@ namespace db {
       const llvm::Value *values[3] =
           { (llvm::Value *) inst, inst->getOperand(0), inst->getOperand(1) };
 
-      GetValues(context, values, locations, 3, code);
-      x86cmd5byte cmd =
-          {
-            VEX_VALUES[int(VEX::C4)],
-            { X86CMD_MAP_SELECT, locations[2] < xmm8, X86CMD_X, locations[0] < xmm8 },
-            {
-              ARITHMETIC_OPCODES_EXTENSIONS[opcodeIndex],
-              X86CMD_L,
-              XMM_TO_VVVV(locations[1]),
-              X86CMD_W
-            },
-            ARITHMETIC_OPCODES[opcodeIndex],
-            {
-              XMM_TO_ARG(locations[0]),
-              XMM_TO_ARG(locations[2]),
-              REG_REG_MOD
-            }
-          };
-      Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
+      MemoryOperand memory{};
+      bool isMemory =
+          GetMemoryOperand(context, values[2], &memory);
+      if (!isMemory && ARITHMETIC_COMMUTATIVE[opcodeIndex] &&
+          GetMemoryOperand(context, values[1], &memory))
+        {
+          values[1] = values[2];
+          isMemory  = true;
+        }
+
+      GetValues(context, values, locations, isMemory ? 2 : 3, code);
+      byte cmd[MAX_INSTRUCTION_SIZE]{};
+      size_t size =
+          EncodeVexCmd(cmd, ARITHMETIC_OPCODES_EXTENSIONS[opcodeIndex], X86CMD_W,
+                       XMM_TO_VVVV(locations[1]), ARITHMETIC_OPCODES[opcodeIndex],
+                       locations[0], locations[2], isMemory ? &memory : nullptr);
+      PushDataReference(context, isMemory ? &memory : nullptr, code->text.size, size, size);
+      Write(code, cmd, size);
       CleanupValues(context, values, 3, code);
       return true;
     }
 
+  /* An add or a subtraction with the contract flag takes a multiply   *
+   * with the flag that it is the only use of. Nothing between the two *
+   * may store or call, the operands of the multiply must not change.  */
+  static const llvm::Instruction *GetFusedMultiply(const llvm::Value *value)
+    {
+      assert(value);
+
+      auto *inst =
+          llvm::dyn_cast<llvm::Instruction>(value);
+      if (!inst || (inst->getOpcode() != llvm::Instruction::FAdd &&
+                    inst->getOpcode() != llvm::Instruction::FSub))
+        return nullptr;
+      if (!inst->hasAllowContract()) return nullptr;
+
+      for (unsigned i = 2; i-- > 0; )
+        {
+          auto *mulInst =
+              llvm::dyn_cast<llvm::Instruction>(inst->getOperand(i));
+          if (!mulInst || mulInst->getOpcode() != llvm::Instruction::FMul ||
+              !mulInst->hasAllowContract() || !mulInst->hasOneUse() ||
+              mulInst->getParent() != inst->getParent())
+            continue;
+
+          const llvm::Instruction *next = mulInst->getNextNode();
+          while (next != inst &&
+                 !llvm::isa<llvm::StoreInst>(next) && !llvm::isa<llvm::CallInst>(next))
+            next = next->getNextNode();
+          if (next == inst) return mulInst;
+        }
+
+      return nullptr;
+    }
+
+  /* The multiply is not emitted, its add does it */
+  static bool IsFusedMultiply(const llvm::Value *value)
+    {
+      assert(value);
+
+      auto *mulInst =
+          llvm::dyn_cast<llvm::Instruction>(value);
+      if (!mulInst || mulInst->getOpcode() != llvm::Instruction::FMul ||
+          !mulInst->hasOneUse())
+        return false;
+
+      return GetFusedMultiply(*mulInst->user_begin()) == mulInst;
+    }
+
+  /* The addend is moved to the destination first, the 231 forms *
+   * add the product to it or subtract it with a single rounding. */
+  static bool EmitFusedMultiply
+      (Context *context, const llvm::Instruction *inst,
+       const llvm::Instruction *mulInst, x86Code *code)
+    {
+      assert(context && inst && mulInst && code);
+
+      bool isMinuend = inst->getOperand(0) == mulInst;
+      size_t opcodeIndex =
+          inst->getOpcode() == llvm::Instruction::FAdd ? vfmadd231sd  :
+          isMinuend                                    ? vfmsub231sd  :
+                                                         vfnmadd231sd ;
+      const llvm::Value *addend = inst->getOperand(isMinuend ? 1 : 0);
+
+      Location locations[3]{};
+      const llvm::Value *values[3] =
+          { (llvm::Value *) inst, mulInst->getOperand(0), mulInst->getOperand(1) };
+
+      MemoryOperand memory{};
+      bool isMemory =
+          GetMemoryOperand(context, values[2], &memory);
+      if (!isMemory && GetMemoryOperand(context, values[1], &memory))
+        {
+          values[1] = values[2];
+          isMemory  = true;
+        }
+
+      GetValues(context, values, locations, isMemory ? 2 : 3, code);
+
+      MemoryOperand addendMemory{};
+      MachineInstruction move{ MoveXmmXmm, locations[0] };
+      if (GetMemoryOperand(context, addend, &addendMemory))
+        move = { LoadXmm, locations[0], mem, addendMemory.base, addendMemory.displacement };
+      else
+        move.source = GetVariable(context, addend)->location;
+      WriteInstruction(context, &move, code);
+
+      byte cmd[MAX_INSTRUCTION_SIZE]{};
+      size_t size =
+          EncodeVexCmd(cmd, FUSED_OPCODES_EXTENSIONS, FUSED_W, XMM_TO_VVVV(locations[1]),
+                       FUSED_OPCODES[opcodeIndex], locations[0], locations[2],
+                       isMemory ? &memory : nullptr, X86CMD_MAP_0F38);
+      PushDataReference(context, isMemory ? &memory : nullptr, code->text.size, size, size);
+      Write(code, cmd, size);
+      CleanupValues(context, values, 3, code);
+
+      ++context->globalContext->fusedMultiplies;
+      return true;
+    }
+
   static bool EmitRet
       (Context *context, const llvm::Instruction *inst, x86Code *code)
     {
@@ -196,27 +501,48 @@ namespace db {
       auto *returnInst =
           (llvm::ReturnInst *) inst;
 
-      Location location{};
       const llvm::Value *returnValue =
           returnInst->getReturnValue();
+      if (returnValue)
+        {
+          Location location{};
+          GetValues(context, &returnValue, &location, 1, code);
 
-      GetValues(context, &returnValue, &location, 1, code);
-      x86cmd5byte cmd =
-          {
-            VEX_VALUES[int(VEX::C4)],
-            { X86CMD_MAP_SELECT, rax < r8, X86CMD_X, location < xmm8 },
-            { VMOVQ_REG_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, X86CMD_W },
-            VMOVQ_OPCODE,
-            { REG_TO_ARG(rax), XMM_TO_ARG(location), REG_REG_MOD }
-          };
-      Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
+          MachineInstruction move{ MoveXmmXmm, RETURN_REGISTER, location };
+          WriteInstruction(context, &move, code);
+          CleanupValues(context, &returnValue, 1, code);
+        }
 
+      RestoreCalleeRegisters(context, code);
       PopUsingRegisters(context, code);
-      if (context->status.inMain)
-        Write(code, MAIN_RET, sizeof(MAIN_RET));
-      else
-        Write(code,      RET, sizeof(     RET));
-      return true;
+      if (!context->status.inMain)
+        return Write(code, RET, sizeof(RET));
+
+      if (context->globalContext->options->instrumentPath)
+        {
+          Reference ref =
+              {
+                code->text.size,
+                code->text.size + CALL_OFFSET,
+                sizeof(CALL),
+                PROFILE_WRITE_FUNCTION,
+                jmp
+              };
+          PushCallReference(context->globalContext, &ref);
+          Write(code, &CALL, sizeof(CALL));
+        }
+
+      Write(code, MAIN_RET, sizeof(MAIN_RET));
+      Reference ref =
+          {
+            code->text.size,
+            code->text.size + CALL_OFFSET,
+            sizeof(CALL),
+            MAIN_EXIT_FUNCTION,
+            jmp
+          };
+      PushCallReference(context->globalContext, &ref);
+      return Write(code, &CALL, sizeof(CALL));
     }
 
   static bool EmitAssignment
@@ -238,29 +564,8 @@ namespace db {
         }
 
       GetValues(context, values, locations, 2, code);
-      if (locations[1] < xmm8)
-        {
-          x86cmd4byte cmd =
-              {
-                VEX_VALUES[int(VEX::C5)],
-                { VMOVQ_XMM_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, locations[0] < xmm8 },
-                VMOVQ_OPCODE,
-                { XMM_TO_ARG(locations[1]), XMM_TO_ARG(locations[0]), REG_REG_MOD }
-              };
-          Write(code, &cmd, VEX_SIZES[int(VEX::C5)]);
-        }
-      else
-        {
-          x86cmd5byte cmd =
-              {
-                VEX_VALUES[int(VEX::C4)],
-                { X86CMD_MAP_SELECT, VMOVQ_XMM_XMM_B, X86CMD_X, locations[0] < xmm8 },
-                { VMOVQ_XMM_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, X86CMD_W },
-                VMOVQ_OPCODE,
-                { XMM_TO_ARG(locations[1]), XMM_TO_ARG(locations[0]), REG_REG_MOD }
-              };
-          Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
-        }
+      MachineInstruction move{ MoveXmmXmm, locations[0], locations[1] };
+      WriteInstruction(context, &move, code);
       CleanupValues(context, values, 2, code);
       return true;
     }
@@ -273,6 +578,8 @@ namespace db {
           (llvm::FCmpInst *) inst;
 
       size_t cmpTypeIndex = 0;
+      if (IsFusedCompare(inst, &cmpTypeIndex)) return true;
+
       switch (cmpInst->getPredicate())
         {
           #define CASE(TYPE, VALUE) \
@@ -289,31 +596,24 @@ namespace db {
       const llvm::Value *values[3] =
           { (llvm::Value *) inst, inst->getOperand(0), inst->getOperand(1) };
 
-      GetValues(context, values, locations, 3, code);
-
-      if (locations[2] < xmm8)
-        {
-          x86cmd4byte cmd =
-              {
-                VEX_VALUES[int(VEX::C5)],
-                { VCMPSD_OPCODES_EXTENSIONS, X86CMD_L, XMM_TO_VVVV(locations[1]), locations[0] < xmm8 },
-                VCMPSD_OPCODE,
-                { XMM_TO_ARG(locations[2]), XMM_TO_ARG(locations[0]), REG_REG_MOD }
-              };
-          Write(code, &cmd, VEX_SIZES[int(VEX::C5)]);
-        }
-      else
+      MemoryOperand memory{};
+      bool isMemory =
+          GetMemoryOperand(context, values[2], &memory);
+      if (!isMemory && GetMemoryOperand(context, values[1], &memory))
         {
-          x86cmd5byte cmd =
-              {
-                VEX_VALUES[int(VEX::C4)],
-                { X86CMD_MAP_SELECT, VCMPSD_B, X86CMD_X, locations[0] < xmm8 },
-                { VCMPSD_OPCODES_EXTENSIONS, X86CMD_L, XMM_TO_VVVV(locations[1]), locations[0] < xmm8 },
-                VCMPSD_OPCODE,
-                { XMM_TO_ARG(locations[2]), XMM_TO_ARG(locations[0]), REG_REG_MOD }
-              };
-          Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
+          values[1]    = values[2];
+          cmpTypeIndex = SWAPPED_COMPARES[cmpTypeIndex];
+          isMemory     = true;
         }
+
+      GetValues(context, values, locations, isMemory ? 2 : 3, code);
+      byte cmd[MAX_INSTRUCTION_SIZE]{};
+      size_t size =
+          EncodeVexCmd(cmd, VCMPSD_OPCODES_EXTENSIONS, X86CMD_W, XMM_TO_VVVV(locations[1]),
+                       VCMPSD_OPCODE, locations[0], locations[2], isMemory ? &memory : nullptr);
+      PushDataReference(context, isMemory ? &memory : nullptr, code->text.size,
+                        size, size + sizeof(COMPARE_ARGUMENTS[cmpTypeIndex]));
+      Write(code, cmd, size);
       Write(code, &COMPARE_ARGUMENTS[cmpTypeIndex], sizeof(COMPARE_ARGUMENTS[cmpTypeIndex]));
       CleanupValues(context, values, 3, code);
       return true;
@@ -326,107 +626,255 @@ namespace db {
       auto *branchInst =
           (llvm::BranchInst *) inst;
 
+      if (!branchInst->isConditional())
+        return EmitJump(context, jmp, branchInst->getSuccessor(0), code);
+      /* IRBuilder folds a compare of two literals to i1 */
+      if (auto *constant = llvm::dyn_cast<llvm::ConstantInt>(branchInst->getCondition()))
+        return EmitJump(context, jmp, branchInst->getSuccessor(constant->isOne() ? 0 : 1), code);
+      if (IsFusedCompare(branchInst->getCondition(), nullptr))
+        return EmitFusedBr(context, branchInst, code);
+
       Location location{};
-      const llvm::Value *value = inst->getOperand(0);
+      const llvm::Value *value = branchInst->getCondition();
 
-      if (!branchInst->isConditional())
+      GetValues(context, &value, &location, 1, code);
+      MachineInstruction move{ MoveGprXmm, rax, location };
+      WriteInstruction(context, &move, code);
+      Write(code, &CMP_EAX_EAX, sizeof(CMP_EAX_EAX));
+      CleanupValues(context, &value, 1, code);
+
+      return
+          EmitConditionalJump(context, jne,
+                              branchInst->getSuccessor(0), branchInst->getSuccessor(1), code);
+    }
+
+  /* A compare used only by the branch right after it is not materialized *
+   * as a mask, the branch emits vucomisd and jumps on the flags instead. */
+  static bool IsFusedCompare(const llvm::Value *value, size_t *cmpTypeIndex)
+    {
+      assert(value);
+
+      auto *cmpInst =
+          llvm::dyn_cast<llvm::FCmpInst>(value);
+      if (!cmpInst || !cmpInst->hasOneUse()) return false;
+
+      auto *branchInst =
+          llvm::dyn_cast_or_null<llvm::BranchInst>(cmpInst->getNextNode());
+      if (!branchInst || branchInst->isUnconditional() ||
+          branchInst->getCondition() != cmpInst)
+        return false;
+
+      size_t index = 0;
+      switch (cmpInst->getPredicate())
         {
-          Reference ref =
-              {
-                code->text.size,
-                code->text.size + JMP_ADDRESS_OFFSET,
-                sizeof(JMP),
-                value->getName().data()
-              };
-          PushJumpReference(context, &ref);
-          Write(code, JMP, sizeof(JMP));
-          return true;
+          #define CASE(TYPE, VALUE) \
+            case llvm::CmpInst::TYPE: index = VALUE; break
+
+          CASE(FCMP_OEQ, eq); CASE(FCMP_ONE, ne);
+          CASE(FCMP_OGT, gt); CASE(FCMP_OLT, lt);
+
+          #undef CASE
+
+          default: return false;
         }
 
-      GetValues(context, &value, &location, 1, code);
-      x86cmd5byte cmd =
-          {
-            VEX_VALUES[int(VEX::C4)],
-            { X86CMD_MAP_SELECT, rax < r8, X86CMD_X, location < xmm8 },
-            { VMOVQ_REG_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, VMOVQ_REG_XMM_W },
-            VMOVQ_OPCODE,
-            { REG_TO_ARG(rax), XMM_TO_ARG(location), REG_REG_MOD }
-          };
-      Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
-      Write(code, &CMP_EAX_EAX, sizeof(CMP_EAX_EAX));
-      CleanupValues(context, &value, 3, code);
+      if (cmpTypeIndex) *cmpTypeIndex = index;
+      return true;
+    }
+
+  static bool EmitFusedBr
+      (Context *context, const llvm::BranchInst *branchInst, x86Code *code)
+    {
+      assert(context && branchInst && code);
+      auto *cmpInst =
+          (llvm::FCmpInst *) branchInst->getCondition();
 
-      Reference thenRef =
+      size_t cmpTypeIndex = 0;
+      IsFusedCompare(cmpInst, &cmpTypeIndex);
+      bool isSwapped = FUSED_COMPARE_SWAPS[cmpTypeIndex];
+
+      Location locations[2]{};
+      const llvm::Value *values[2] =
           {
-            code->text.size,
-            code->text.size + JNE_ADDRESS_OFFSET,
-            sizeof(JNE),
-            inst->getOperand(1)->getName().data()
+            cmpInst->getOperand(isSwapped ? 1 : 0),
+            cmpInst->getOperand(isSwapped ? 0 : 1)
           };
-      PushJumpReference(context, &thenRef);
-      Write(code, JNE, sizeof(JNE));
-      Reference elseRef =
+
+      /* ja needs its operands in order, only eq and ne can swap them */
+      MemoryOperand memory{};
+      bool isMemory =
+          GetMemoryOperand(context, values[1], &memory);
+      if (!isMemory && SWAPPED_COMPARES[cmpTypeIndex] == cmpTypeIndex &&
+          GetMemoryOperand(context, values[0], &memory))
+        {
+          values[0] = values[1];
+          isMemory  = true;
+        }
+
+      GetValues(context, values, locations, isMemory ? 1 : 2, code);
+      byte cmd[MAX_INSTRUCTION_SIZE]{};
+      size_t size =
+          EncodeVexCmd(cmd, VUCOMISD_OPCODES_EXTENSIONS, X86CMD_W, VUCOMISD_VVVV,
+                       VUCOMISD_OPCODE, locations[0], locations[1], isMemory ? &memory : nullptr);
+      PushDataReference(context, isMemory ? &memory : nullptr, code->text.size, size, size);
+      Write(code, cmd, size);
+      CleanupValues(context, values, 2, code);
+
+      const llvm::BasicBlock *thenBlock = branchInst->getSuccessor(0);
+      const llvm::BasicBlock *elseBlock = branchInst->getSuccessor(1);
+      if (cmpTypeIndex == eq)
+        EmitJump(context, jp, elseBlock, code);
+
+      return
+          EmitConditionalJump(context, FUSED_COMPARE_CONDITIONS[cmpTypeIndex],
+                              thenBlock, elseBlock, code);
+    }
+
+  static bool EmitJump
+      (Context *context, JumpCondition condition,
+       const llvm::BasicBlock *target, x86Code *code)
+    {
+      assert(context && target && code);
+
+      bool isJmp = condition == jmp;
+      if (isJmp && target == context->nextBlock) return true;
+
+      Reference ref =
           {
             code->text.size,
-            code->text.size + JMP_ADDRESS_OFFSET,
-            sizeof(JMP),
-            inst->getOperand(2)->getName().data()
+            code->text.size + (isJmp ? JMP_ADDRESS_OFFSET : JCC_ADDRESS_OFFSET),
+            isJmp ? sizeof(JMP) : sizeof(JCC),
+            target->getName().data(),
+            condition
           };
-      PushJumpReference(context, &elseRef);
-      Write(code, JMP, sizeof(JMP));
-      return true;
+      PushJumpReference(context, &ref);
+
+      byte cmd[sizeof(JCC)]{};
+      size_t size =
+          WriteJump(cmd, condition, true, code->text.size, code->text.size);
+      return Write(code, cmd, size);
+    }
+
+  /* Jumps to the block right after the current one are dropped, *
+   * when it is the then-block the condition is inverted instead. */
+  static bool EmitConditionalJump
+      (Context *context, JumpCondition condition,
+       const llvm::BasicBlock *thenBlock, const llvm::BasicBlock *elseBlock, x86Code *code)
+    {
+      assert(context && thenBlock && elseBlock && code);
+
+      if (thenBlock == context->nextBlock)
+        return EmitJump(context, INVERT_CONDITION(condition), elseBlock, code);
+
+      EmitJump(context, condition, thenBlock, code);
+      return EmitJump(context, jmp, elseBlock, code);
     }
 
   static bool EmitCall
       (Context *context, const llvm::Instruction *inst, x86Code *code)
     {
       assert(context && inst && code);
+      auto *callInst =
+          (llvm::CallBase *) inst;
 
-      size_t argsCount =
-          inst->getNumOperands() - 1;
-      if (argsCount >= MAX_ARGS_COUNT) return false;
+      size_t argsCount = callInst->arg_size();
+      auto *argLocations =
+          (ArgumentLocation *) calloc(argsCount ? argsCount : 1, sizeof(ArgumentLocation));
+      if (!argLocations) OUT_OF_MEMORY(return false);
 
-      Location locations[MAX_ARGS_COUNT + 1]{};
-      const llvm::Value *values[MAX_ARGS_COUNT + 1] =
-          { (llvm::Value *) inst };
-      for (size_t i = 0; i < argsCount; ++i)
-        values[i + 1] = inst->getOperand(i);
-      GetValues(context, values, locations, argsCount, code);
+      size_t stackCount = 0;
+      GetArgumentLocations(callInst, argLocations, &stackCount);
+      EmitCounter(context, code);
+
+      SavedRegisters saved{};
+      SaveLiveRegisters(context, callInst, argLocations, &saved, code);
+
+      size_t stackSize =
+          (stackCount + stackCount % 2)*VARIABLE_SIZE;
+      if (stackCount % 2)
+        {
+          byte sub[sizeof(SUB_RSP)]{};
+          memcpy(sub, SUB_RSP, sizeof(SUB_RSP));
+          WRITE_INT32(&sub[SUB_RSP_OFFSET], VARIABLE_SIZE);
+          Write(code, sub, sizeof(sub));
+        }
+
+      for (size_t i = argsCount; i-- > 0; )
+        {
+          if (argLocations[i].kind != MemOperand) continue;
+
+          Location location{};
+          const llvm::Value *value = callInst->getArgOperand(unsigned(i));
+
+          GetValues(context, &value, &location, 1, code);
+          MachineInstruction move{ MoveGprXmm, rax, location };
+          WriteInstruction(context, &move, code);
+          Write(code, PUSH_RAX, sizeof(PUSH_RAX));
+          CleanupValues(context, &value, 1, code);
+        }
 
       for (size_t i = 0; i < argsCount; ++i)
         {
-          x86cmd5byte cmd =
+          ArgumentLocation argLocation = argLocations[i];
+          if (argLocation.kind == MemOperand) continue;
+
+          const llvm::Value *value = callInst->getArgOperand(unsigned(i));
+          if (argLocation.kind == XmmOperand && IsBlockVariable(context, value))
+            {
+              Location location = GetVariable(context, value)->location;
+              if (location < argLocation.location)
+                {
+                  MemoryOperand slot = saved.slots[location];
+                  MachineInstruction load =
+                      { LoadXmm, argLocation.location, mem, slot.base, slot.displacement };
+                  WriteInstruction(context, &load, code);
+                  continue;
+                }
+            }
+
+          Location location{};
+          GetValues(context, &value, &location, 1, code);
+          MachineInstruction move =
               {
-                VEX_VALUES[int(VEX::C4)],
-                { X86CMD_MAP_SELECT, (Location) i < r8, X86CMD_X, locations[i] < xmm8 },
-                { VMOVQ_REG_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, VMOVQ_REG_XMM_W },
-                VMOVQ_OPCODE,
-                { REG_TO_ARG((Location) i), XMM_TO_ARG(locations[i]), REG_REG_MOD }
+                argLocation.kind == XmmOperand ? MoveXmmXmm : MoveGprXmm,
+                argLocation.location, location
               };
-          Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
+          WriteInstruction(context, &move, code);
+          CleanupValues(context, &value, 1, code);
         }
+      free(argLocations);
 
       Reference ref =
           {
             code->text.size,
             code->text.size + CALL_OFFSET,
             sizeof(CALL),
-            inst->getOperand(argsCount)->getName().data()
+            callInst->getCalledOperand()->getName().data(),
+            jmp
           };
       PushCallReference(context->globalContext, &ref);
       Write(code, &CALL, sizeof(CALL));
 
-      x86cmd5byte cmd =
-          {
-            VEX_VALUES[int(VEX::C4)],
-            { X86CMD_MAP_SELECT, rax < r8, X86CMD_X, locations[0] < xmm8 },
-            { VMOVQ_XMM_XMM_OPCODES_EXTENSIONS, X86CMD_L, VMOVQ_VVVV, VMOVQ_REG_XMM_W },
-            VMOVQ_XMM_REG_OPCODE,
-            { REG_TO_ARG(rax), XMM_TO_ARG(locations[0]), REG_REG_MOD }
-          };
-      Write(code, &cmd, VEX_SIZES[int(VEX::C4)]);
-      CleanupValues(context, values, argsCount, code);
-      return true;
+      if (stackSize)
+        {
+          byte add[sizeof(ADD_RSP)]{};
+          memcpy(add, ADD_RSP, sizeof(ADD_RSP));
+          WRITE_INT32(&add[ADD_RSP_OFFSET], stackSize);
+          Write(code, add, sizeof(add));
+        }
+
+      if (!inst->getType()->isVoidTy())
+        {
+          Location location{};
+          const llvm::Value *value = inst;
+
+          GetValues(context, &value, &location, 1, code);
+          MachineInstruction move{ MoveXmmXmm, location, RETURN_REGISTER };
+          WriteInstruction(context, &move, code);
+          CleanupValues(context, &value, 1, code);
+        }
+
+      return RestoreLiveRegisters(context, &saved, code);
     }
 
 }
\ No newline at end of file
@@ -94,9 +94,9 @@ namespace db
 
   static void *VisitASTNode(Module *theModule, Status *status, ASTNode *node);
 
-  Module *GenerateModule(AST *ast)
+  Module *GenerateModule(AST *ast, const ModuleOptions *options)
     {
-      assert(ast);
+      assert(ast && options);
 
       Module *theModule =
           (Module *) calloc(1, sizeof(Module));
@@ -104,6 +104,12 @@ namespace db
         OUT_OF_MEMORY(return nullptr);
 
       CreateModule(theModule, "AST");
+      if (options->isContracted)
+        {
+          llvm::FastMathFlags flags{};
+          flags.setAllowContract();
+          theModule->builder->setFastMathFlags(flags);
+        }
 
       CreateLibrary(theModule);
       llvm::Constant *endl =
@@ -503,7 +509,7 @@ namespace db
 
        ASTNode *temp = node->left;
        for ( ; temp; temp = temp->right)
-         params.push_back((llvm::Value *) VisitASTNode(theModule, status, node->left));
+         params.push_back((llvm::Value *) VisitASTNode(theModule, status, temp->left));
 
        llvm::ArrayRef<llvm::Value *> llvmParams(params);
        CreateScanfCall(theModule, &llvmParams);
@@ -649,6 +655,10 @@ namespace db
    functionType =
         llvm::FunctionType::get(voidType, { type }, false);
    CreateFunction(theModule, functionType, "printString" , { "name" });
+
+   functionType =
+        llvm::FunctionType::get(voidType, false);
+   CreateFunction(theModule, functionType, "exit" , {});
  }
 
   llvm::Function *CreateFunction
@@ -897,12 +907,23 @@ namespace db
       llvm::Function *printDouble =
           theModule->theModule->getFunction("printDouble");
 
+      /* Globals are pointers, the double ones are printed by value */
       size_t size = values->size();
       for (size_t i = 0; i < size; ++i)
-        if (values->data()[i]->getType()->isDoubleTy())
-          theModule->builder->CreateCall(printDouble, values->data()[i]);
-        else
-          theModule->builder->CreateCall(printString, values->data()[i]);
+        {
+          llvm::Value *value = values->data()[i];
+          auto *global = llvm::dyn_cast<llvm::GlobalVariable>(value);
+          if (global && global->getValueType()->isDoubleTy())
+            {
+              value = theModule->builder->CreateLoad(global->getValueType(), global);
+              SetName(value);
+            }
+
+          if (value->getType()->isDoubleTy())
+            theModule->builder->CreateCall(printDouble, value);
+          else
+            theModule->builder->CreateCall(printString, value);
+        }
       return nullptr;
     }
 
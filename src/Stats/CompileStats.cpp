@@ -0,0 +1,309 @@
+#include "Stats/CompileStats.h"
+
+#include <llvm-c/Disassembler.h>
+#include <llvm-c/Target.h>
+
+#include <sys/resource.h>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cassert>
+
+/* Every allocation of the process goes through here, LLVM and the   *
+ * threads of the codegen included: malloc, calloc, realloc and the  *
+ * aligned ones that aligned operator new calls. glibc exports the   *
+ * allocator under these names as well, free is left to it. Nothing *
+ * is counted until CountAllocations, so a compile without          *
+ * statistics pays only for a load and a branch.                     */
+extern "C" {
+  void *__libc_malloc(size_t size);
+  void *__libc_calloc(size_t count, size_t size);
+  void *__libc_realloc(void *pointer, size_t size);
+  void *__libc_memalign(size_t alignment, size_t size);
+}
+
+static std::atomic<bool>     IsCounting      { false };
+static std::atomic<uint64_t> AllocationsCount{ 0 };
+static std::atomic<uint64_t> AllocatedBytes  { 0 };
+
+static void CountAllocation(size_t size)
+  {
+    if (!IsCounting.load(std::memory_order_relaxed)) return;
+
+    AllocationsCount.fetch_add(1   , std::memory_order_relaxed);
+    AllocatedBytes  .fetch_add(size, std::memory_order_relaxed);
+  }
+
+extern "C" void *malloc(size_t size) noexcept
+  {
+    CountAllocation(size);
+    return __libc_malloc(size);
+  }
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+  {
+    CountAllocation(count*size);
+    return __libc_calloc(count, size);
+  }
+
+extern "C" void *realloc(void *pointer, size_t size) noexcept
+  {
+    CountAllocation(size);
+    return __libc_realloc(pointer, size);
+  }
+
+extern "C" void *memalign(size_t alignment, size_t size) noexcept
+  {
+    CountAllocation(size);
+    return __libc_memalign(alignment, size);
+  }
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size) noexcept
+  {
+    if (!alignment || alignment & (alignment - 1))
+      {
+        errno = EINVAL;
+        return nullptr;
+      }
+
+    CountAllocation(size);
+    return __libc_memalign(alignment, size);
+  }
+
+extern "C" int posix_memalign(void **pointer, size_t alignment, size_t size) noexcept
+  {
+    if (alignment % sizeof(void *) || alignment & (alignment - 1))
+      return EINVAL;
+
+    CountAllocation(size);
+    void *memory = __libc_memalign(alignment, size);
+    if (!memory) return ENOMEM;
+
+    *pointer = memory;
+    return 0;
+  }
+
+namespace db {
+
+  const char DISASSEMBLER_TRIPLE[] = "x86_64-unknown-linux-gnu";
+  const size_t DISASSEMBLY_SIZE = 128;
+
+  const char *const PHASE_NAMES[] =
+      {
+        /*ParsePhase  */ "GetAST"         ,
+        /*ModulePhase */ "GenerateModule" ,
+        /*PrintPhase  */ "PrintModule"    ,
+        /*CodeGenPhase*/ "GenerateX86Code",
+        /*ELFPhase    */ "GenerateELF"    ,
+      };
+  const char *const PEEPHOLE_RULE_NAMES[] =
+      {
+        /*SelfMove     */ "selfMove"     ,
+        /*StoreToLoad  */ "storeToLoad"  ,
+        /*RedundantLoad*/ "redundantLoad",
+        /*DeadStore    */ "deadStore"    ,
+        /*MoveChain    */ "moveChain"    ,
+      };
+
+  static double GetSeconds(const timespec *start, const timespec *end);
+  static long GetPeakRss();
+  static LLVMDisasmContextRef CreateDisassembler();
+  static size_t CountInstructions(LLVMDisasmContextRef disassembler, const byte *text, size_t size);
+  static void DumpJsonString(const char *string, FILE *file);
+
+  void CountAllocations()
+    {
+      IsCounting.store(true, std::memory_order_relaxed);
+    }
+
+  void StartPhase(CompileStatistics *statistics, CompilePhase phase)
+    {
+      assert(statistics && phase < COMPILE_PHASES_COUNT);
+
+      PhaseStatistics *phaseStatistics = &statistics->phases[phase];
+      phaseStatistics->allocationsStart    = AllocationsCount.load(std::memory_order_relaxed);
+      phaseStatistics->allocatedBytesStart = AllocatedBytes  .load(std::memory_order_relaxed);
+      clock_gettime(CLOCK_MONOTONIC         , &phaseStatistics->wallStart);
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &phaseStatistics-> cpuStart);
+    }
+
+  void StopPhase(CompileStatistics *statistics, CompilePhase phase)
+    {
+      assert(statistics && phase < COMPILE_PHASES_COUNT);
+
+      timespec wallEnd{}, cpuEnd{};
+      clock_gettime(CLOCK_MONOTONIC         , &wallEnd);
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, & cpuEnd);
+
+      PhaseStatistics *phaseStatistics = &statistics->phases[phase];
+      phaseStatistics->wallTime += GetSeconds(&phaseStatistics->wallStart, &wallEnd);
+      phaseStatistics-> cpuTime += GetSeconds(&phaseStatistics-> cpuStart, & cpuEnd);
+      phaseStatistics->allocations +=
+          AllocationsCount.load(std::memory_order_relaxed) - phaseStatistics->allocationsStart;
+      phaseStatistics->allocatedBytes +=
+          AllocatedBytes  .load(std::memory_order_relaxed) - phaseStatistics->allocatedBytesStart;
+      phaseStatistics->peakRss = GetPeakRss();
+      phaseStatistics->isRun   = true;
+    }
+
+  void DumpTimeReport(const CompileStatistics *statistics, const x86Code *code, FILE *file)
+    {
+      assert(statistics && file);
+
+      fprintf(file, "Time report:\n"
+                    "  %-16s %10s %10s %12s %12s %12s\n",
+              "phase", "wall, ms", "cpu, ms", "allocations", "alloc, KiB", "peak RSS, KiB");
+      for (size_t i = 0; i < COMPILE_PHASES_COUNT; ++i)
+        {
+          const PhaseStatistics *phase = &statistics->phases[i];
+          if (!phase->isRun) continue;
+
+          fprintf(file, "  %-16s %10.3f %10.3f %12" PRIu64 " %12" PRIu64 " %12ld\n",
+                  PHASE_NAMES[i], phase->wallTime*1e3, phase->cpuTime*1e3,
+                  phase->allocations, phase->allocatedBytes >> 10, phase->peakRss);
+        }
+      fprintf(file, "  peak RSS %ld KiB, %" PRIu64 " allocations\n",
+              GetPeakRss(), AllocationsCount.load(std::memory_order_relaxed));
+
+      if (!code) return;
+
+      LLVMDisasmContextRef disassembler = CreateDisassembler();
+
+      fprintf(file, "Functions:\n"
+                    "  %-24s %12s %8s %8s %8s\n",
+              "name", "instructions", "bytes", "spills", "fixups");
+      for (size_t i = 0; i < code->statistics.size; ++i)
+        {
+          const FunctionStatistics *function = &code->statistics.data[i];
+          const Symbol *symbol = &code->symbols.data[function->symbol];
+          fprintf(file, "  %-24s %12zu %8zu %8zu %8zu%s\n",
+                  (const char *) &code->symbolNames.data[symbol->name],
+                  CountInstructions(disassembler, &code->text.data[symbol->offset], symbol->size),
+                  symbol->size, function->spills, function->fixups,
+                  function->isReused ? " (cached)" : "");
+        }
+
+      if (!code->isLoaded)
+        {
+          fprintf(file, "Peephole:\n");
+          for (size_t i = 0; i < PEEPHOLE_RULES_COUNT; ++i)
+            fprintf(file, "  %-24s %12zu\n", PEEPHOLE_RULE_NAMES[i], code->peepholeHits[i]);
+          fprintf(file, "Fused multiplies: %zu\n", code->fusedMultiplies);
+        }
+
+      if (disassembler) LLVMDisasmDispose(disassembler);
+    }
+
+  /* One object on a line: the phases that ran, the totals and the functions */
+  void DumpStatisticsJson(const CompileStatistics *statistics, const x86Code *code, FILE *file)
+    {
+      assert(statistics && file);
+
+      fprintf(file, "{\"phases\":[");
+      bool isFirst = true;
+      for (size_t i = 0; i < COMPILE_PHASES_COUNT; ++i)
+        {
+          const PhaseStatistics *phase = &statistics->phases[i];
+          if (!phase->isRun) continue;
+
+          fprintf(file, "%s{\"name\":\"%s\",\"wall\":%.9f,\"cpu\":%.9f,"
+                        "\"allocations\":%" PRIu64 ",\"allocatedBytes\":%" PRIu64 ",\"peakRss\":%ld}",
+                  isFirst ? "" : ",", PHASE_NAMES[i], phase->wallTime, phase->cpuTime,
+                  phase->allocations, phase->allocatedBytes, phase->peakRss);
+          isFirst = false;
+        }
+      fprintf(file, "],\"peakRss\":%ld,\"allocations\":%" PRIu64 ",\"allocatedBytes\":%" PRIu64,
+              GetPeakRss(), AllocationsCount.load(std::memory_order_relaxed),
+              AllocatedBytes.load(std::memory_order_relaxed));
+
+      if (!code)
+        {
+          fprintf(file, "}\n");
+          return;
+        }
+
+      LLVMDisasmContextRef disassembler = CreateDisassembler();
+
+      fprintf(file, ",\"textBytes\":%zu,\"functions\":[", code->text.size);
+      for (size_t i = 0; i < code->statistics.size; ++i)
+        {
+          const FunctionStatistics *function = &code->statistics.data[i];
+          const Symbol *symbol = &code->symbols.data[function->symbol];
+          fprintf(file, "%s{\"name\":", i ? "," : "");
+          DumpJsonString((const char *) &code->symbolNames.data[symbol->name], file);
+          fprintf(file, ",\"instructions\":%zu,\"bytes\":%zu,\"spills\":%zu,\"fixups\":%zu,"
+                        "\"cached\":%s}",
+                  CountInstructions(disassembler, &code->text.data[symbol->offset], symbol->size),
+                  symbol->size, function->spills, function->fixups,
+                  function->isReused ? "true" : "false");
+        }
+      fprintf(file, "]");
+      if (!code->isLoaded)
+        {
+          fprintf(file, ",\"peephole\":{");
+          for (size_t i = 0; i < PEEPHOLE_RULES_COUNT; ++i)
+            fprintf(file, "%s\"%s\":%zu", i ? "," : "", PEEPHOLE_RULE_NAMES[i], code->peepholeHits[i]);
+          fprintf(file, "},\"fusedMultiplies\":%zu", code->fusedMultiplies);
+        }
+      fprintf(file, "}\n");
+
+      if (disassembler) LLVMDisasmDispose(disassembler);
+    }
+
+  static double GetSeconds(const timespec *start, const timespec *end)
+    {
+      assert(start && end);
+      return double(end->tv_sec - start->tv_sec) + double(end->tv_nsec - start->tv_nsec)*1e-9;
+    }
+
+  static long GetPeakRss()
+    {
+      rusage usage{};
+      return getrusage(RUSAGE_SELF, &usage) ? 0 : usage.ru_maxrss;
+    }
+
+  static LLVMDisasmContextRef CreateDisassembler()
+    {
+      LLVMInitializeX86TargetInfo();
+      LLVMInitializeX86TargetMC();
+      LLVMInitializeX86Disassembler();
+      return LLVMCreateDisasm(DISASSEMBLER_TRIPLE, nullptr, 0, nullptr, nullptr);
+    }
+
+  /* A byte that does not decode is counted as an instruction */
+  static size_t CountInstructions(LLVMDisasmContextRef disassembler, const byte *text, size_t size)
+    {
+      assert(text || !size);
+
+      if (!disassembler) return 0;
+
+      char disassembly[DISASSEMBLY_SIZE]{};
+      size_t count = 0;
+      for (size_t position = 0; position < size; ++count)
+        {
+          size_t instructionSize =
+              LLVMDisasmInstruction(disassembler, (uint8_t *) &text[position], size - position,
+                                    position, disassembly, sizeof(disassembly));
+          position += instructionSize ? instructionSize : 1;
+        }
+
+      return count;
+    }
+
+  static void DumpJsonString(const char *string, FILE *file)
+    {
+      assert(string && file);
+
+      fputc('"', file);
+      for (; *string; ++string)
+        {
+          unsigned char symbol = (unsigned char) *string;
+          if (symbol == '"' || symbol == '\\') fprintf(file, "\\%c", symbol);
+          else if (symbol < ' ')               fprintf(file, "\\u%04x", symbol);
+          else                                 fputc(symbol, file);
+        }
+      fputc('"', file);
+    }
+
+}
@@ -1,31 +1,207 @@
 #include "Module/Module.h"
 #include "CodeGen/x86Code.h"
+#include "Cache/CompileCache.h"
+#include "Stats/CompileStats.h"
+#include "Utils/ErrorMessage.h"
 
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+
+static const char RUN_OPTION[]         = "--run";
+static const char NO_CACHE_OPTION[]    = "--no-cache";
+static const char CACHE_STATS_OPTION[] = "--cache-stats";
+static const char JOBS_OPTION[]        = "--jobs=";
+static const char FP_CONTRACT_OPTION[] = "--fp-contract";
+static const char INSTRUMENT_OPTION[]  = "--instrument";
+static const char PROFILE_USE_OPTION[] = "--profile-use";
+static const char TIME_REPORT_OPTION[] = "--time-report";
+static const char STATS_OPTION[]       = "--stats=";
+static const char STATS_JSON_FORMAT[]  = "json";
+static const char BACKEND_OPTION[]     = "--backend=";
+static const char X86_BACKEND[]        = "x86";
+static const char LLVM_BACKEND[]       = "llvm";
+static const char PROFILE_EXTENSION[]  = ".profile";
+
+/* The report goes to stderr with the other statistics. The JSON is for *
+ * scripts: it is the only thing on stdout, unless the code is run and  *
+ * stdout is its own.                                                   */
+static void DumpStatistics
+    (const db::CompileStatistics *statistics, const db::x86Code *code,
+     bool isReported, bool isJson, bool isRun)
+  {
+    if (isReported) db::DumpTimeReport(statistics, code, stderr);
+    if (isJson)     db::DumpStatisticsJson(statistics, code, isRun ? stderr : stdout);
+  }
 
 int main(const int argc, const char *const argv[])
   {
-    if (argc < 3)
+    bool isRun         = false;
+    bool isCached      = true;
+    bool isCacheDumped = false;
+    bool isContracted  = false;
+    bool isInstrumented = false;
+    bool isProfileUsed  = false;
+    bool isReported     = false;
+    bool isJson         = false;
+    bool isLLVM         = false;
+    size_t threadsCount = 0;
+    const char *paths[2]{};
+    size_t pathsCount = 0;
+    for (int i = 1; i < argc; ++i)
+      {
+        if      (!strcmp(argv[i], RUN_OPTION        )) isRun         = true;
+        else if (!strcmp(argv[i], NO_CACHE_OPTION   )) isCached      = false;
+        else if (!strcmp(argv[i], CACHE_STATS_OPTION)) isCacheDumped = true;
+        else if (!strcmp(argv[i], FP_CONTRACT_OPTION)) isContracted  = true;
+        else if (!strcmp(argv[i], INSTRUMENT_OPTION )) isInstrumented = true;
+        else if (!strcmp(argv[i], PROFILE_USE_OPTION)) isProfileUsed  = true;
+        else if (!strcmp(argv[i], TIME_REPORT_OPTION)) isReported     = true;
+        else if (!strncmp(argv[i], STATS_OPTION, sizeof(STATS_OPTION) - 1))
+          {
+            isJson = !strcmp(argv[i] + sizeof(STATS_OPTION) - 1, STATS_JSON_FORMAT);
+            if (!isJson)
+              {
+                fprintf(stderr, "Unknown statistics format \"%s\".\n", argv[i]);
+                return 1;
+              }
+          }
+        else if (!strncmp(argv[i], BACKEND_OPTION, sizeof(BACKEND_OPTION) - 1))
+          {
+            const char *backend = argv[i] + sizeof(BACKEND_OPTION) - 1;
+            isLLVM = !strcmp(backend, LLVM_BACKEND);
+            if (!isLLVM && strcmp(backend, X86_BACKEND))
+              {
+                fprintf(stderr, "Unknown backend \"%s\".\n", argv[i]);
+                return 1;
+              }
+          }
+        else if (!strncmp(argv[i], JOBS_OPTION, sizeof(JOBS_OPTION) - 1))
+          threadsCount = strtoull(argv[i] + sizeof(JOBS_OPTION) - 1, nullptr, 10);
+        else if (!strncmp(argv[i], "--", 2))
+          {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+            return 1;
+          }
+        else if (pathsCount < sizeof(paths)/sizeof(paths[0]))
+          paths[pathsCount++] = argv[i];
+      }
+
+    if (pathsCount < (isRun ? 1 : 2))
       {
         printf("No source file.\n"
-               "Use %s [source file name] [destiny file name]\n" ,
-               argv[0]);
+               "Use %s [source file name] [destiny file name]\n"
+               " or %s %s [source file name] to run it in memory\n"
+               "Options: %s, %s, %sN, %s, %s, %s, %s, %s%s, %s%s|%s\n",
+               argv[0], argv[0], RUN_OPTION,
+               NO_CACHE_OPTION, CACHE_STATS_OPTION, JOBS_OPTION, FP_CONTRACT_OPTION,
+               INSTRUMENT_OPTION, PROFILE_USE_OPTION, TIME_REPORT_OPTION,
+               STATS_OPTION, STATS_JSON_FORMAT, BACKEND_OPTION, X86_BACKEND, LLVM_BACKEND);
+        return 0;
+      }
+
+    /* Options that change the emitted code, they are part of the cache key. *
+     * Floating point results are exact by default, --fp-contract lets a     *
+     * multiply and an add be rounded once.                                  */
+    const char *signature = isContracted ? FP_CONTRACT_OPTION : "";
+
+    /* --backend=llvm compiles the module with the X86 backend of LLVM to *
+     * compare the emitter against. It keeps nothing in the cache and has *
+     * no counters to instrument.                                         */
+    if (isLLVM && (isInstrumented || isProfileUsed))
+      {
+        fprintf(stderr, "%s and %s need the %s backend.\n",
+                INSTRUMENT_OPTION, PROFILE_USE_OPTION, X86_BACKEND);
+        return 1;
+      }
+    if (isLLVM) isCached = false;
+
+    /* The profile is the absolute source path with PROFILE_EXTENSION:   *
+     * --instrument builds write it wherever they run, --profile-use     *
+     * reads it. Neither goes through the cache, the counters and the    *
+     * profile are not part of its key.                                  */
+    char profilePath[PATH_MAX]{};
+    db::Profile profile{};
+    if (isInstrumented || isProfileUsed)
+      {
+        char sourcePath[PATH_MAX]{};
+        if (!realpath(paths[0], sourcePath) ||
+            snprintf(profilePath, sizeof(profilePath), "%s%s",
+                     sourcePath, PROFILE_EXTENSION) >= int(sizeof(profilePath)))
+          FAIL_TO_OPEN(paths[0], return 1);
+        if (isProfileUsed && !db::LoadProfile(&profile, profilePath)) return 1;
+        isCached = false;
+      }
+
+    /* --run has no ELF to take from the cache, it still reuses function bodies */
+    if (isReported || isJson) db::CountAllocations();
+    db::CompileStatistics statistics{};
+    db::CompileCache cache{};
+    isCached =
+        isCached && db::OpenCompileCache(&cache, paths[0], signature);
+    if (isCached && !isRun && db::FetchFromCache(&cache, paths[1]))
+      {
+        if (isCacheDumped) db::DumpCacheStatistics(&cache, stderr);
+        DumpStatistics(&statistics, nullptr, isReported, isJson, isRun);
         return 0;
       }
 
+    db::StartPhase(&statistics, db::ParsePhase);
     db::AST *ast =
-        db::GetAST(argv[1]);
+        db::GetAST(paths[0]);
+    db::StopPhase (&statistics, db::ParsePhase);
+
+    db::StartPhase(&statistics, db::ModulePhase);
+    db::ModuleOptions moduleOptions{ isContracted };
     db::Module *theModule =
-        db::GenerateModule(ast);
+        db::GenerateModule(ast, &moduleOptions);
+    db::StopPhase (&statistics, db::ModulePhase);
 
+    db::StartPhase(&statistics, db::PrintPhase);
     theModule->theModule->print(llvm::errs(), nullptr);
+    db::StopPhase (&statistics, db::PrintPhase);
 
+    db::CodeGenOptions options =
+        {
+          isCached ? &cache : nullptr, signature, threadsCount,
+          isInstrumented ? profilePath : nullptr,
+          isProfileUsed  ? &profile    : nullptr
+        };
+    db::StartPhase(&statistics, db::CodeGenPhase);
     db::x86Code *code =
-        db::GenerateX86Code(theModule);
-    db::GenerateELF(code, argv[2]);
+        isLLVM ?
+        db::GenerateLLVMCode(theModule, &options) :
+        db::GenerateX86Code (theModule, &options);
+    db::StopPhase (&statistics, db::CodeGenPhase);
+    db::DestroyProfile(&profile);
+    if (!code) return 1;
+    if (isCacheDumped)
+      fprintf(stderr, "Functions: %zu emitted, %zu reused\n",
+              code->functions.emitted, code->functions.reused);
+    if (isRun)
+      {
+        if (isCached) db::TrimCache(&cache);
+        if (isCacheDumped && isCached) db::DumpCacheStatistics(&cache, stderr);
+        db::DestroyModule(theModule);
+        db::DestroyAST(ast);
+        DumpStatistics(&statistics, code, isReported, isJson, isRun);
+        db::RunX86Code(code);
+
+        db::DestroyX86Code(code);
+        return 1;
+      }
+
+    db::StartPhase(&statistics, db::ELFPhase);
+    bool isGenerated = db::GenerateELF(code, paths[1]);
+    db::StopPhase (&statistics, db::ELFPhase);
+    if (isGenerated && isCached)
+      db::StoreInCache(&cache, paths[1]);
+    if (isCacheDumped && isCached) db::DumpCacheStatistics(&cache, stderr);
+    DumpStatistics(&statistics, code, isReported, isJson, isRun);
 
     db::DestroyX86Code(code);
     db::DestroyModule(theModule);
     db::DestroyAST(ast);
     return 0;
-  }
+  }
\ No newline at end of file